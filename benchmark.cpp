@@ -0,0 +1,601 @@
+// vim: set sw=2 ts=2 sts=2 et tw=100:
+//
+// benchmark: timings of pdf-simple-sign's phases over a synthetic corpus
+//
+// Copyright (c) 2017 - 2020, Přemysl Eric Janouch <p@janouch.name>
+//
+// Permission to use, copy, modify, and/or distribute this software for any
+// purpose with or without fee is hereby granted.
+//
+// THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+// WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+// SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+// WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+// OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+// CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+//
+
+// The signer's internals are all static, so simply take them in, save for its main()
+#define main pdf_simple_sign_main
+#include "pdf-simple-sign.cpp"
+#undef main
+
+#include <array>
+#include <chrono>
+#include <regex>
+
+// -------------------------------------------------------------------------------------------------
+
+/// Parameters of a synthetic document
+struct corpus_params {
+  size_t objects = 1000;  ///< Number of cross-reference table entries, including object 0
+  size_t updates = 0;     ///< Number of incremental updates chained through /Prev
+  size_t depth = 1;       ///< Depth of the page tree, with a page at each level
+  uint64_t size = 0;      ///< Approximate file size to pad the document to, or zero for none
+};
+
+/// Serializes a synthetic document, keeping track of object offsets
+class corpus_writer {
+  FILE* fp;
+  std::vector<uint64_t> offsets;  ///< Offsets of objects within the last section
+  std::string buffer;             ///< Data waiting to be written out
+
+  bool flush() {
+    bool ok = fwrite(buffer.data(), 1, buffer.length(), fp) == buffer.length();
+    buffer.clear();
+    return ok;
+  }
+
+  void begin(size_t n) {
+    if (offsets.size() <= n)
+      offsets.resize(n + 1, 0);
+    offsets[n] = offset;
+    write(ssprintf("%zu 0 obj\n", n));
+  }
+
+public:
+  uint64_t offset = 0;            ///< Current file offset
+
+  explicit corpus_writer(FILE* fp) : fp(fp) {}
+
+  void write(const std::string& data) {
+    buffer += data;
+    offset += data.length();
+    if (buffer.length() >= (1 << 20))
+      flush();
+  }
+  void object(size_t n, const std::string& contents) {
+    begin(n);
+    write(contents + "\nendobj\n");
+  }
+
+  /// Write a stream of `length' bytes of filler data, which isn't held in memory at once
+  bool stream(size_t n, uint64_t length) {
+    begin(n);
+    write(ssprintf("<< /Length %llu >>\nstream\n", (unsigned long long) length));
+    if (!flush())
+      return false;
+
+    std::string chunk(1 << 20, '#');
+    for (uint64_t left = length; left; ) {
+      auto len = std::min(left, uint64_t(chunk.length()));
+      if (fwrite(chunk.data(), 1, len, fp) != len)
+        return false;
+      left -= len;
+    }
+    offset += length;
+    write("\nendstream\nendobj\n");
+    return true;
+  }
+
+  /// Finish a section with a cross-reference table covering all objects written to it since,
+  /// returning the offset of the table
+  uint64_t xref(size_t size, uint64_t prev, bool first) {
+    auto xref_offset = offset;
+    write("xref\n");
+    for (size_t n = 0; n < offsets.size(); ) {
+      if (!offsets[n] && !(first && !n)) {
+        n++;
+        continue;
+      }
+      size_t end = n;
+      while (end < offsets.size() && (offsets[end] || (first && !end)))
+        end++;
+      write(ssprintf("%zu %zu\n", n, end - n));
+      for (; n < end; n++)
+        write(n ? ssprintf("%010llu 00000 n \n", (unsigned long long) offsets[n])
+                : std::string("0000000000 65535 f \n"));
+    }
+    write(ssprintf("trailer\n<< /Size %zu /Root 1 0 R", size));
+    if (!first)
+      write(ssprintf(" /Prev %llu", (unsigned long long) prev));
+    write(ssprintf(" >>\nstartxref\n%llu\n%%%%EOF\n", (unsigned long long) xref_offset));
+    offsets.clear();
+    return xref_offset;
+  }
+
+  bool close() { return flush() && !fflush(fp); }
+};
+
+/// Write out a synthetic document with the given parameters, returning false on I/O errors.
+/// The page tree is a chain of Pages nodes, each with a page of its own, and anything that remains
+/// of the object count is filled with small dictionaries, which the updates then replace.
+static bool corpus_generate(const corpus_params& params, FILE* fp) {
+  size_t pages_first = 2, page_first = pages_first + params.depth;
+  size_t padding_n = page_first + params.depth, filler_first = padding_n + !!params.size;
+  size_t size = std::max(params.objects, filler_first);
+
+  corpus_writer w(fp);
+  w.write("%PDF-1.4\n%\xc2\xb5\xc2\xb6\n");
+  w.object(1, "<< /Type/Catalog /Pages 2 0 R >>");
+  for (size_t i = 0; i < params.depth; i++) {
+    std::string kids = ssprintf("%zu 0 R", page_first + i);
+    if (i + 1 < params.depth)
+      kids += ssprintf(" %zu 0 R", pages_first + i + 1);
+    std::string parent = i ? ssprintf(" /Parent %zu 0 R", pages_first + i - 1) : "";
+    w.object(pages_first + i, ssprintf("<< /Type/Pages%s /Kids [%s] /Count %zu >>",
+                                       parent.c_str(), kids.c_str(), params.depth - i));
+    w.object(page_first + i, ssprintf("<< /Type/Page /Parent %zu 0 R /MediaBox [0 0 595 842] >>",
+                                      pages_first + i));
+  }
+  for (size_t n = filler_first; n < size; n++)
+    w.object(n, ssprintf("<< /Filler %zu /Values [1 2.5 (three) /Four true null] >>", n));
+
+  // Roughly what the cross-reference tables and updates are going to take up
+  if (params.size) {
+    uint64_t rest = w.offset + 20 * size + 100 * params.updates + 200;
+    if (!w.stream(padding_n, params.size > rest ? params.size - rest : 0))
+      return false;
+  }
+
+  auto prev = w.xref(size, 0, true);
+  for (size_t i = 0; i < params.updates; i++) {
+    if (filler_first < size) {
+      auto n = filler_first + i % (size - filler_first);
+      w.object(n, ssprintf("<< /Filler %zu /Update %zu >>", n, i + 1));
+    } else {
+      w.object(1, "<< /Type/Catalog /Pages 2 0 R >>");
+    }
+    prev = w.xref(size, prev, false);
+  }
+  return w.close();
+}
+
+// -------------------------------------------------------------------------------------------------
+
+using benchmark_clock = std::chrono::steady_clock;
+
+static double seconds_since(benchmark_clock::time_point start) {
+  return std::chrono::duration<double>(benchmark_clock::now() - start).count();
+}
+
+/// Passes signing through to another signer, measuring how long it takes
+struct timed_signer : pdf_signer {
+  const pdf_signer& inner;
+  mutable double seconds = 0;
+
+  explicit timed_signer(const pdf_signer& inner) : inner(inner) {
+    X509_up_ref(certificate = inner.certificate);
+    chain = X509_chain_up_ref(inner.chain);
+  }
+
+  std::string sign(const unsigned char* data, size_t length,
+                   std::string& signature) const override {
+    auto start = benchmark_clock::now();
+    auto err = inner.sign(data, length, signature);
+    seconds += seconds_since(start);
+    return err;
+  }
+};
+
+/// Generate a throwaway RSA key with a self-signed certificate, returning false on failure
+static bool generate_signer(pdf_key_signer& signer) {
+  EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, nullptr);
+  bool ok = ctx && EVP_PKEY_keygen_init(ctx) > 0 &&
+    EVP_PKEY_CTX_set_rsa_keygen_bits(ctx, 2048) > 0 &&
+    EVP_PKEY_keygen(ctx, &signer.private_key) > 0 && (signer.certificate = X509_new()) &&
+    X509_set_version(signer.certificate, 2) &&
+    ASN1_INTEGER_set(X509_get_serialNumber(signer.certificate), 1) &&
+    X509_gmtime_adj(X509_getm_notBefore(signer.certificate), 0) &&
+    X509_gmtime_adj(X509_getm_notAfter(signer.certificate), 86400) &&
+    X509_NAME_add_entry_by_txt(X509_get_subject_name(signer.certificate), "CN", MBSTRING_ASC,
+                               reinterpret_cast<const unsigned char*>("Benchmark"), -1, -1, 0) &&
+    X509_set_issuer_name(signer.certificate, X509_get_subject_name(signer.certificate)) &&
+    X509_set_pubkey(signer.certificate, signer.private_key) &&
+    X509_sign(signer.certificate, signer.private_key, EVP_sha256());
+  EVP_PKEY_CTX_free(ctx);
+  return ok;
+}
+
+/// Phases of signing a document that get timed separately
+enum phase {
+  OPEN,        ///< Opening and mapping the input file
+  HASH,        ///< Hashing the original document
+  INITIALIZE,  ///< pdf_updater::initialize(), i.e., loading cross-references
+  GET,         ///< Parsing every object through pdf_updater::get()
+  SERIALIZE,   ///< Serializing every object through pdf_serialize()
+  PAGES,       ///< Indexing the page tree
+  UPDATE,      ///< Building the incremental update with the signature field
+  DIGEST,      ///< Finishing the digest over the update
+  SIGN,        ///< The signature operation itself
+  ASSEMBLE,    ///< Building the signature around it
+  PHASE_COUNT
+};
+
+static const char* phase_names[PHASE_COUNT] = {
+  "open", "hash", "initialize", "get", "serialize",
+  "pages", "update", "digest", "sign", "assemble",
+};
+
+/// Durations of the individual phases, in seconds
+using phase_timings = std::array<double, PHASE_COUNT>;
+
+/// Go through all phases of signing once, returning an error message on failure
+static std::string benchmark_run(const char* path, const pdf_signer& signer,
+    phase_timings& t, size_t& parsed) {
+  auto start = benchmark_clock::now();
+  input_file input;
+  auto err = input.open(path);
+  if (!err.empty())
+    return err;
+  t[OPEN] = seconds_since(start);
+
+  start = benchmark_clock::now();
+  pdf_digest digest(input.data, input.length);
+  EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+  bool hashed = ctx && digest.resume(ctx);
+  EVP_MD_CTX_free(ctx);
+  if (!hashed)
+    return openssl_error("OpenSSL failure");
+  t[HASH] = seconds_since(start);
+
+  pdf_arena arena;
+  std::string updates;
+  pdf_updater pdf(input.data, input.length, updates);
+  start = benchmark_clock::now();
+  if (!(err = pdf.initialize()).empty())
+    return err;
+  t[INITIALIZE] = seconds_since(start);
+
+  // Parse everything in a separate instance, so that signing starts out with a cold cache.
+  // Object generations aren't exposed, but generated documents only use zero.
+  pdf_updater all(input.data, input.length, updates);
+  if (!(err = all.initialize()).empty())
+    return err;
+
+  auto size = all.trailer["Size"];
+  std::vector<const pdf_object*> objects;
+  start = benchmark_clock::now();
+  for (uint n = 1; n < size.number; n++) {
+    const auto& o = all.get(n, 0);
+    if (o.type != pdf_object::NIL && o.type != pdf_object::END)
+      objects.push_back(&o);
+  }
+  t[GET] = seconds_since(start);
+  parsed = objects.size();
+
+  std::string out;
+  start = benchmark_clock::now();
+  for (auto o : objects) {
+    out.clear();
+    pdf_serialize(*o, out);
+  }
+  t[SERIALIZE] = seconds_since(start);
+
+  auto root_ref = pdf.trailer["Root"];
+  const auto& root = pdf.get(root_ref.n, root_ref.generation);
+  pdf_page_index pages(pdf);
+  start = benchmark_clock::now();
+  if (!(err = pages.initialize(root)).empty() || !pages.count())
+    return err.empty() ? "the document has no pages" : err;
+  pdf_object page;
+  if (!(err = pages.get(pages.count() - 1, page)).empty())
+    return err;
+  t[PAGES] = seconds_since(start);
+
+  size_t sign_off = 0, sign_len = 0, required = 0;
+  start = benchmark_clock::now();
+  if (!(err = pdf_sign_update(pdf, root_ref.n, root_ref.generation, pages, pages.count() - 1,
+                              4096, sign_off, sign_len)).empty())
+    return err;
+  t[UPDATE] = seconds_since(start);
+
+  std::string md;
+  start = benchmark_clock::now();
+  if (!(err = pdf_digest_signed_ranges(pdf, digest, sign_off, sign_len, md)).empty())
+    return err;
+  t[DIGEST] = seconds_since(start);
+
+  timed_signer timed(signer);
+  start = benchmark_clock::now();
+  if (!(err = pdf_fill_in_signature(pdf, timed, md, sign_off, sign_len, required,
+                                    nullptr)).empty())
+    return err;
+  t[ASSEMBLE] = seconds_since(start) - timed.seconds;
+  t[SIGN] = timed.seconds;
+  return "";
+}
+
+/// Benchmark a document, and print the best timings of each phase as a line of JSON
+static bool benchmark(const char* path, const std::string& description, const pdf_signer& signer,
+    long runs) {
+  phase_timings best = {};
+  size_t parsed = 0;
+  for (long i = 0; i < runs; i++) {
+    phase_timings t = {};
+    auto err = benchmark_run(path, signer, t, parsed);
+    if (!err.empty()) {
+      fprintf(stderr, "%s: %s\n", path, err.c_str());
+      return false;
+    }
+    for (size_t k = 0; k < PHASE_COUNT; k++)
+      best[k] = i ? std::min(best[k], t[k]) : t[k];
+  }
+
+  struct stat st = {};
+  (void) stat(path, &st);
+  auto line = ssprintf("{%s, \"bytes\": %lld, \"parsed\": %zu, \"runs\": %ld",
+                       description.c_str(), (long long) st.st_size, parsed, runs);
+  for (size_t k = 0; k < PHASE_COUNT; k++)
+    line += ssprintf(", \"%s\": %.6f", phase_names[k], best[k]);
+  printf("%s}\n", line.c_str());
+  fflush(stdout);
+  return true;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+/// What pdf_updater::initialize() used to do before find_startxref(), returning -1 on failure
+static long long regex_startxref(const char* document, size_t document_length) {
+  static std::regex haystack_re(R"([\s\S]*\sstartxref\s+(\d+)\s+%%EOF)");
+  std::string haystack(document_length < 1024 ? document : document + document_length - 1024,
+                       document + document_length);
+
+  std::smatch m;
+  if (!std::regex_search(haystack, m, haystack_re, std::regex_constants::match_continuous))
+    return -1;
+  return std::stoull(m.str(1));
+}
+
+/// What pdf_updater::version() used to do before find_header_version()
+static int regex_header_version(const char* document, size_t document_length) {
+  static std::regex version_re(R"((?:^|[\r\n])%(?:!PS-Adobe-\d\.\d )?PDF-(\d)\.(\d)[\r\n])");
+  std::string haystack(document, std::min(document_length, size_t(1024)));
+
+  std::smatch m;
+  if (std::regex_search(haystack, m, version_re, std::regex_constants::match_default))
+    return std::stoul(m.str(1)) * 10 + std::stoul(m.str(2));
+  return 0;
+}
+
+/// Compare the startxref and header lookups with the regular expressions they have replaced,
+/// and print the best per-call timings of both as a line of JSON
+static bool benchmark_scanners(const char* path, const std::string& description, long runs) {
+  input_file input;
+  auto err = input.open(path);
+  if (!err.empty()) {
+    fprintf(stderr, "%s: %s\n", path, err.c_str());
+    return false;
+  }
+
+  auto data = input.data, tail = data + input.length - std::min(input.length, size_t(1024));
+  size_t offset = 0;
+  long long expected = find_startxref(tail, data + input.length, offset) ? offset : -1;
+  int version = find_header_version(data, data + std::min(input.length, size_t(1024)));
+  if (regex_startxref(data, input.length) != expected ||
+      regex_header_version(data, input.length) != version) {
+    fprintf(stderr, "%s: %s\n", path, "the scanners disagree with the regular expressions");
+    return false;
+  }
+
+  // Static regular expressions are compiled by the check above, and aren't timed
+  const long calls = 20000;
+  double best_regex = 0, best_scanners = 0;
+  volatile long long sink = 0;
+  for (long i = 0; i < runs; i++) {
+    auto start = benchmark_clock::now();
+    for (long k = 0; k < calls; k++)
+      sink = sink + regex_startxref(data, input.length) + regex_header_version(data, input.length);
+    auto seconds = seconds_since(start);
+    best_regex = i ? std::min(best_regex, seconds) : seconds;
+
+    start = benchmark_clock::now();
+    for (long k = 0; k < calls; k++)
+      sink = sink + find_startxref(tail, data + input.length, offset) + offset +
+        find_header_version(data, data + std::min(input.length, size_t(1024)));
+    seconds = seconds_since(start);
+    best_scanners = i ? std::min(best_scanners, seconds) : seconds;
+  }
+
+  printf("{%s, \"bytes\": %zu, \"calls\": %ld, \"runs\": %ld, \"regex_us\": %.3f, "
+         "\"scanners_us\": %.3f}\n", description.c_str(), input.length, calls, runs,
+         best_regex / calls * 1e6, best_scanners / calls * 1e6);
+  fflush(stdout);
+  return true;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+/// Parse a comma-separated list of sizes, which may use binary K, M, and G suffixes
+static bool parse_list(const char* s, std::vector<uint64_t>& out) {
+  out.clear();
+  while (*s) {
+    char* end = nullptr;
+    errno = 0;
+    uint64_t value = strtoull(s, &end, 10);
+    if (errno || end == s)
+      return false;
+    switch (*end) {
+    case 'K': value <<= 10; end++; break;
+    case 'M': value <<= 20; end++; break;
+    case 'G': value <<= 30; end++; break;
+    }
+    if (*end && *end != ',')
+      return false;
+    out.push_back(value);
+    s = *end ? end + 1 : end;
+  }
+  return !out.empty();
+}
+
+int main(int argc, char* argv[]) {
+  auto invocation_name = argv[0];
+  auto usage = [=] {
+    die(1, "Usage: %s [-h] [-n RUNS] [-o DIRECTORY [-G]] [--key KEY-PAIR --password PASSWORD]"
+        " [--scanners] [--objects LIST] [--updates LIST] [--depth LIST] [--size LIST] [FILE]...",
+        invocation_name);
+  };
+
+  static struct option opts[] = {
+    {"help", no_argument, 0, 'h'},
+    {"runs", required_argument, 0, 'n'},
+    {"output", required_argument, 0, 'o'},
+    {"generate", no_argument, 0, 'G'},
+    {"key", required_argument, 0, 'k'},
+    {"password", required_argument, 0, 'P'},
+    {"scanners", no_argument, 0, 's'},
+    {"objects", required_argument, 0, 'O'},
+    {"updates", required_argument, 0, 'U'},
+    {"depth", required_argument, 0, 'D'},
+    {"size", required_argument, 0, 'S'},
+    {nullptr, 0, 0, 0},
+  };
+
+  // Each axis is varied separately, starting from the default parameters
+  std::vector<uint64_t> axis_objects = {10, 1000, 100000, 1000000};
+  std::vector<uint64_t> axis_updates = {10, 100, 1000};
+  std::vector<uint64_t> axis_depth = {10, 100};
+  std::vector<uint64_t> axis_size = {16 << 20, 256 << 20};
+
+  const char* directory = nullptr, * key = nullptr, * password = "";
+  bool generate_only = false, scanners = false;
+  long runs = 3;
+  while (1) {
+    int option_index = 0;
+    auto c = getopt_long(argc, const_cast<char* const*>(argv), "hn:o:G", opts, &option_index);
+    if (c == -1)
+      break;
+
+    char* end = nullptr;
+    switch (c) {
+    case 'n':
+      errno = 0, runs = strtol(optarg, &end, 10);
+      if (errno || *end || runs <= 0)
+        die(1, "%s: must be a positive number", optarg);
+      break;
+    case 'o':
+      directory = optarg;
+      break;
+    case 'G':
+      generate_only = true;
+      break;
+    case 'k':
+      key = optarg;
+      break;
+    case 'P':
+      password = optarg;
+      break;
+    case 's':
+      scanners = true;
+      break;
+    case 'O':
+    case 'U':
+    case 'D':
+    case 'S': {
+      auto& axis = c == 'O' ? axis_objects : c == 'U' ? axis_updates :
+        c == 'D' ? axis_depth : axis_size;
+      if (!parse_list(optarg, axis))
+        die(1, "%s: must be a comma-separated list of numbers", optarg);
+      break;
+    }
+    default:
+      usage();
+    }
+  }
+
+  argv += optind;
+  argc -= optind;
+  if (generate_only && (!directory || argc))
+    usage();
+
+  // Only the cross-reference and header lookups, which need no key pair
+  if (scanners && !generate_only) {
+    bool ok = true;
+    for (int i = 0; i < argc; i++)
+      ok &= benchmark_scanners(argv[i], "\"file\": " + json_string(argv[i]), runs);
+    if (argc)
+      return !ok;
+
+    auto tmpdir = getenv("TMPDIR");
+    auto path = std::string(directory ? directory : tmpdir && *tmpdir ? tmpdir : "/tmp") +
+      "/scanners.pdf";
+    corpus_params params;
+    params.size = 100 << 10;
+    auto fp = fopen(path.c_str(), "wb");
+    if (!fp)
+      die(1, "%s: %s", path.c_str(), strerror(errno));
+    bool written = corpus_generate(params, fp);
+    if (fclose(fp) || !written)
+      die(1, "%s: %s", path.c_str(), strerror(errno));
+    ok = benchmark_scanners(path.c_str(), "\"scanners\": true", runs);
+    if (!directory)
+      (void) unlink(path.c_str());
+    return !ok;
+  }
+
+  pdf_key_signer signer;
+  std::string err;
+  if (key && !(err = is_uri(key) ? signer.load_store(key, password)
+                                 : signer.load_pkcs12(key, password)).empty())
+    die(2, "Error: %s", err.c_str());
+  if (!key && !generate_signer(signer))
+    die(2, "Error: %s", openssl_error("failed to generate a key pair").c_str());
+
+  // Documents given on the command line replace the synthetic corpus
+  bool ok = true;
+  for (int i = 0; i < argc; i++)
+    ok &= benchmark(argv[i], "\"file\": " + json_string(argv[i]), signer, runs);
+  if (argc)
+    return !ok;
+
+  std::vector<corpus_params> corpus;
+  for (auto value : axis_objects)
+    corpus.push_back(corpus_params()), corpus.back().objects = value;
+  for (auto value : axis_updates)
+    corpus.push_back(corpus_params()), corpus.back().updates = value;
+  for (auto value : axis_depth)
+    corpus.push_back(corpus_params()), corpus.back().depth = std::max(value, uint64_t(1));
+  for (auto value : axis_size)
+    corpus.push_back(corpus_params()), corpus.back().size = value;
+
+  for (const auto& params : corpus) {
+    auto name = ssprintf("objects-%zu-updates-%zu-depth-%zu-size-%llu.pdf", params.objects,
+                         params.updates, params.depth, (unsigned long long) params.size);
+    std::string path;
+    if (directory) {
+      path = std::string(directory) + "/" + name;
+    } else {
+      auto tmpdir = getenv("TMPDIR");
+      path = std::string(tmpdir && *tmpdir ? tmpdir : "/tmp") + "/" + name;
+    }
+
+    auto fp = fopen(path.c_str(), "wb");
+    if (!fp)
+      die(1, "%s: %s", path.c_str(), strerror(errno));
+    bool written = corpus_generate(params, fp);
+    if (fclose(fp) || !written)
+      die(1, "%s: %s", path.c_str(), strerror(errno));
+
+    if (!generate_only)
+      ok &= benchmark(path.c_str(), ssprintf("\"objects\": %zu, \"updates\": %zu, \"depth\": %zu, "
+                                             "\"size\": %llu", params.objects, params.updates,
+                                             params.depth, (unsigned long long) params.size),
+                      signer, runs);
+    if (!directory)
+      (void) unlink(path.c_str());
+    else if (generate_only)
+      printf("%s\n", path.c_str());
+  }
+  return !ok;
+}
@@ -26,19 +26,38 @@
 #include <qrencode.h>
 
 #include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <exception>
 #include <fstream>
 #include <functional>
 #include <iostream>
+#include <limits>
+#include <map>
 #include <memory>
 #include <optional>
 #include <sstream>
 #include <string>
+#include <system_error>
+#include <thread>
 #include <tuple>
 #include <unordered_map>
 #include <variant>
 #include <vector>
 
 #include <arpa/inet.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "config.h"
+
+#ifdef HAVE_PDF_SIMPLE_SIGN
+// The signer's internals are all static, so simply take them in,
+// save for its main().
+#define main pdf_simple_sign_main
+#include "../pdf-simple-sign.cpp"
+#undef main
+#endif
 
 using namespace std;
 using attribute = variant<string, double>;
@@ -299,6 +318,75 @@ DefWidget(VLine) {
 	}
 };
 
+/// Layouts and font descriptions shared by all text within a Pango context,
+/// so that each distinct paragraph is only shaped once for any given width,
+/// no matter how many times it gets measured, or how often it repeats.
+/// Cached layouts mustn't be modified, though they follow context changes.
+struct LayoutCache {
+	/// Font family, size, and weight attributes.
+	using font_key = tuple<optional<attribute>, optional<attribute>,
+		optional<attribute>>;
+	/// Markup, font, line height attribute, and width in Pango units.
+	using layout_key = tuple<string, font_key, optional<attribute>, int>;
+
+	struct Layout {
+		PangoLayout *layout = nullptr;  ///< The shaped text
+		double y_offset = 0.;           ///< Vertical offset for line height
+	};
+
+	/// Limit on the number of layouts kept; once reached, all are dropped.
+	static constexpr size_t limit = 4096;
+
+	map<font_key, PangoFontDescription *> fonts;
+	map<layout_key, Layout> layouts;
+
+	LayoutCache() {}
+	LayoutCache(const LayoutCache &) = delete;
+	LayoutCache &operator=(const LayoutCache &) = delete;
+	~LayoutCache() {
+		clear_layouts();
+		for (auto &kv : fonts)
+			pango_font_description_free(kv.second);
+	}
+
+	/// Retrieve the cache of a Pango context, which owns it.
+	static LayoutCache &of(PangoContext *pc) {
+		static const char *key = "lpg-layout-cache";
+		auto self = static_cast<LayoutCache *>(
+			g_object_get_data(G_OBJECT(pc), key));
+		if (!self) {
+			self = new LayoutCache;
+			g_object_set_data_full(G_OBJECT(pc), key, self, [](gpointer p) {
+				delete static_cast<LayoutCache *>(p);
+			});
+		}
+		return *self;
+	}
+
+	/// Retrieve a shared font description, which always has a size.
+	const PangoFontDescription *font(const font_key &key) {
+		if (auto it = fonts.find(key); it != fonts.end())
+			return it->second;
+
+		auto fd = pango_font_description_new();
+		if (auto &v = get<0>(key))
+			pango_font_description_set_family(fd, get<string>(*v).c_str());
+		if (auto &v = get<1>(key))
+			pango_font_description_set_size(fd, get<double>(*v) * PANGO_SCALE);
+		if (auto &v = get<2>(key))
+			pango_font_description_set_weight(fd, PangoWeight(get<double>(*v)));
+		if (!pango_font_description_get_size(fd))
+			pango_font_description_set_size(fd, 10 * PANGO_SCALE);
+		return fonts[key] = fd;
+	}
+
+	void clear_layouts() {
+		for (auto &kv : layouts)
+			g_object_unref(kv.second.layout);
+		layouts.clear();
+	}
+};
+
 DefWidget(Text) {
 	string text;
 	PangoLayout *layout = nullptr;
@@ -323,38 +411,48 @@ DefWidget(Text) {
 		return escaped;
 	}
 
-	void prepare_layout(PangoContext *pc) {
+	/// Pick a layout for the given width in Pango units, or -1 for none.
+	void prepare_layout(PangoContext *pc, int width = -1) {
+		auto &cache = LayoutCache::of(pc);
+		LayoutCache::font_key font{
+			getattr("fontfamily"), getattr("fontsize"), getattr("fontweight")};
+		LayoutCache::layout_key key{text, font, getattr("lineheight"), width};
+		auto it = cache.layouts.find(key);
+		if (it == cache.layouts.end()) {
+			if (cache.layouts.size() >= LayoutCache::limit)
+				cache.clear_layouts();
+			it = cache.layouts.emplace(
+				key, make_layout(pc, cache.font(font), width)).first;
+		}
+
 		g_clear_object(&layout);
-		layout = pango_layout_new(pc);
-		pango_layout_set_markup(layout, text.c_str(), -1);
-		pango_layout_set_alignment(layout, PANGO_ALIGN_LEFT);
+		layout = static_cast<PangoLayout *>(g_object_ref(it->second.layout));
+		y_offset = it->second.y_offset;
+	}
 
-		auto fd = pango_font_description_new();
-		if (auto v = getattr("fontfamily"))
-			pango_font_description_set_family(fd, get<string>(*v).c_str());
-		if (auto v = getattr("fontsize"))
-			pango_font_description_set_size(fd, get<double>(*v) * PANGO_SCALE);
-		if (auto v = getattr("fontweight"))
-			pango_font_description_set_weight(fd, PangoWeight(get<double>(*v)));
+	LayoutCache::Layout make_layout(
+		PangoContext *pc, const PangoFontDescription *fd, int width) {
+		LayoutCache::Layout result;
+		auto pl = result.layout = pango_layout_new(pc);
+		pango_layout_set_markup(pl, text.c_str(), -1);
+		pango_layout_set_alignment(pl, PANGO_ALIGN_LEFT);
+		pango_layout_set_width(pl, width);
 
 		// We need this for the line-height calculation.
 		auto font_size =
 			double(pango_font_description_get_size(fd)) / PANGO_SCALE;
-		if (!font_size)
-			pango_font_description_set_size(fd, (font_size = 10));
 
 		// Supposedly this is how this shit works.
 		// XXX: This will never work if the markup changes the font size.
 		if (auto v = getattr("lineheight")) {
 			auto increment = get<double>(*v) - 1;
-			y_offset = increment * font_size / 2;
-			pango_layout_set_spacing(
-				layout, increment * font_size * PANGO_SCALE);
+			result.y_offset = increment * font_size / 2;
+			pango_layout_set_spacing(pl, increment * font_size * PANGO_SCALE);
 		}
 
 		// FIXME: We don't want to override what's in the markup.
-		pango_layout_set_font_description(layout, fd);
-		pango_font_description_free(fd);
+		pango_layout_set_font_description(pl, fd);
+		return result;
 	}
 
 	virtual tuple<double, double> prepare(PangoContext *pc) override {
@@ -368,10 +466,8 @@ DefWidget(Text) {
 
 	virtual tuple<double, double> prepare_for_size(
 		PangoContext *pc, double width, double) override {
-		prepare_layout(pc);
-
 		// It's difficult to get vertical text, so wrap horizontally.
-		pango_layout_set_width(layout, PANGO_SCALE * width);
+		prepare_layout(pc, int(PANGO_SCALE * width));
 
 		int w, h;
 		pango_layout_get_size(layout, &w, &h);
@@ -383,7 +479,11 @@ DefWidget(Text) {
 		override {
 		g_return_if_fail(layout);
 		// Assuming horizontal text, make it span the whole allocation.
-		pango_layout_set_width(layout, PANGO_SCALE * w);
+		// Cached layouts are shared, so rather than rewrapping this one,
+		// pick another one.
+		if (pango_layout_get_width(layout) != int(PANGO_SCALE * w))
+			prepare_layout(
+				pango_layout_get_context(layout), int(PANGO_SCALE * w));
 		pango_cairo_update_layout(cr, layout);
 		cairo_translate(cr, 0, y_offset);
 		pango_cairo_show_layout(cr, layout);
@@ -430,6 +530,81 @@ static bool read_png_info(image_info &info, const char *data, size_t length) {
 		(info.height = ntohl(*(uint32_t *) (data + 20)));
 }
 
+/// Recently decoded pictures, shared by all documents, so that pictures
+/// such as logos only get decoded once.  Once they take up too much memory,
+/// those that have gone unused for the longest are dropped.
+struct PictureCache {
+	/// Path, modification time, and size of a picture file.
+	using key = tuple<string, time_t, long, off_t>;
+
+	struct Entry {
+		cairo_surface_t *surface = nullptr; ///< The decoded picture
+		image_info info;                    ///< Dimensions and resolution
+		size_t bytes = 0;                   ///< Approximate size in memory
+		unsigned long long used = 0;        ///< When it was last looked up
+	};
+
+	/// Limit on the total size of pictures kept.
+	static constexpr size_t limit = 64 << 20;
+
+	map<key, Entry> entries;
+	size_t bytes = 0;
+	unsigned long long clock = 0;
+
+	PictureCache() {}
+	PictureCache(const PictureCache &) = delete;
+	PictureCache &operator=(const PictureCache &) = delete;
+	~PictureCache() {
+		for (auto &kv : entries)
+			cairo_surface_destroy(kv.second.surface);
+	}
+
+	static PictureCache &shared() {
+		static PictureCache cache;
+		return cache;
+	}
+
+	/// Return a new reference to a known picture, or nullptr.
+	cairo_surface_t *find(const key &k, image_info &info) {
+		auto it = entries.find(k);
+		if (it == entries.end())
+			return nullptr;
+
+		it->second.used = ++clock;
+		info = it->second.info;
+		return cairo_surface_reference(it->second.surface);
+	}
+
+	void erase(map<key, Entry>::iterator it) {
+		cairo_surface_destroy(it->second.surface);
+		bytes -= it->second.bytes;
+		entries.erase(it);
+	}
+
+	void store(const key &k, cairo_surface_t *surface, const image_info &info) {
+		// Older versions of the same file will not be asked for again.
+		auto &path = get<0>(k);
+		for (auto it = entries.lower_bound(key{path,
+				numeric_limits<time_t>::min(), numeric_limits<long>::min(),
+				numeric_limits<off_t>::min()});
+			it != entries.end() && get<0>(it->first) == path; )
+			erase(it++);
+
+		// Cairo keeps 32 bits per pixel.
+		auto size = size_t(info.width) * size_t(info.height) * 4;
+		if (size > limit)
+			return;
+		while (bytes + size > limit)
+			erase(min_element(entries.begin(), entries.end(),
+				[](auto &a, auto &b) {
+					return a.second.used < b.second.used;
+				}));
+
+		entries[k] = {cairo_surface_reference(surface), info, size, ++clock};
+		bytes += size;
+	}
+};
+
 DefWidget(Picture) {
 	double w = 0, h = 0;
 	double scale_x = 1., scale_y = 1.;
@@ -505,22 +680,43 @@ DefWidget(Picture) {
 	}
 
 	Picture(const string &filename) {
+		optional<PictureCache::key> key;
+		if (struct stat st = {}; !stat(filename.c_str(), &st))
+			key = {filename, st.st_mtim.tv_sec, st.st_mtim.tv_nsec, st.st_size};
+
+		auto &cache = PictureCache::shared();
+		image_info info;
+		if (auto known = key ? cache.find(*key, info) : nullptr) {
+			set_surface(known, info);
+			return;
+		}
+
 		ifstream t{filename};
 		stringstream buffer;
 		buffer << t.rdbuf();
 		string picture = buffer.str();
 
-		image_info info;
 		if (auto make_surface = identify(picture, info)) {
-			surface = make_surface();
-			w = info.width;
-			h = info.height;
-			scale_x = info.dpi_x / 72.;
-			scale_y = info.dpi_y / 72.;
+			set_surface(make_surface(), info);
+			if (key)
+				cache.store(*key, surface, info);
 		} else {
 			cerr << "warning: unreadable picture: " << filename << endl;
 		}
 	}
+
+	virtual ~Picture() override {
+		if (surface)
+			cairo_surface_destroy(surface);
+	}
+
+	void set_surface(cairo_surface_t *surface, const image_info &info) {
+		this->surface = surface;
+		w = info.width;
+		h = info.height;
+		scale_x = info.dpi_x / 72.;
+		scale_y = info.dpi_y / 72.;
+	}
 };
 
 // --- QR ----------------------------------------------------------------------
@@ -670,12 +866,158 @@ struct LuaDocument {
 	double page_width = 0.;             ///< Page width in 72 DPI points
 	double page_height = 0.;            ///< Page height in 72 DPI points
 	double page_margin = 0.;            ///< Page margins in 72 DPI points
+
+	string filename;                    ///< Path to the output file
+	FILE *fp = nullptr;                 ///< The output file
+	bool regular = false;               ///< Whether it may be removed
+	string pending;                     ///< Output held back from the file
+	bool started = false;               ///< Whether any page has been shown
+#ifdef HAVE_PDF_SIMPLE_SIGN
+	/// Signatures to add when finishing, which may happen in a finalizer,
+	/// after the Lua objects of the signers have already been collected.
+	vector<shared_ptr<const pdf_signer>> signers;
+	unique_ptr<pdf_digest> digest;      ///< Digest of the pending output
+#endif
+
+	/// Whether the whole output is to be kept in memory, and then signed.
+	bool signing() const {
+#ifdef HAVE_PDF_SIMPLE_SIGN
+		return !signers.empty();
+#else
+		return false;
+#endif
+	}
 };
 
-static int xlua_document_gc(lua_State *L) {
-	auto self = (LuaDocument *) luaL_checkudata(L, 1, XLUA_DOCUMENT_METATABLE);
+/// Cairo's output is held back until a page is shown, so that signatures
+/// can still be requested.  Documents to be signed are held whole in memory,
+/// and hashed as they're being written out, so that they never need
+/// to be read back.
+static cairo_status_t xlua_document_write(
+	void *closure, const unsigned char *data, unsigned int length) {
+	auto self = static_cast<LuaDocument *>(closure);
+	auto p = reinterpret_cast<const char *>(data);
+	if (self->started && !self->signing()) {
+		auto &pending = self->pending;
+		if (fwrite(pending.data(), 1, pending.length(), self->fp)
+			!= pending.length() || fwrite(p, 1, length, self->fp) != length)
+			return CAIRO_STATUS_WRITE_ERROR;
+		pending.clear();
+		return CAIRO_STATUS_SUCCESS;
+	}
+
+	self->pending.append(p, length);
+#ifdef HAVE_PDF_SIMPLE_SIGN
+	if (self->digest)
+		(void) self->digest->extend(p, length);
+#endif
+	return CAIRO_STATUS_SUCCESS;
+}
+
+static PangoContext *xlua_document_setup_context(PangoContext *pc) {
+	// By default the resolution is set to 96 DPI but the PDF surface uses 72.
+	pango_cairo_context_set_resolution(pc, 72.);
+
+#if PANGO_VERSION_CHECK(1, 44, 0)
+	// Otherwise kerning was broken in Pango before 1.48.6.
+	// Seems like this issue: https://gitlab.gnome.org/GNOME/pango/-/issues/562
+	// and might be related to: https://blogs.gnome.org/mclasen/2019/08/
+	pango_context_set_round_glyph_positions(pc, FALSE);
+#endif
+	return pc;
+}
+
+/// Returns a reference to the Pango context shared by all documents, so that
+/// they also share fonts and layouts, updated to match the given target.
+static PangoContext *xlua_document_context(cairo_t *cr) {
+	static PangoContext *pc;
+	if (pc)
+		pango_cairo_update_context(cr, pc);
+	else
+		pc = xlua_document_setup_context(pango_cairo_create_context(cr));
+	return static_cast<PangoContext *>(g_object_ref(pc));
+}
+
+/// Returns the Pango context of the given layout thread, updated to match
+/// the given target.  Pango objects may only be used by one thread at a time,
+/// so each of these contexts has a font map of its own.
+static PangoContext *xlua_document_worker_context(cairo_t *cr, size_t i) {
+	static vector<PangoContext *> contexts;
+	while (contexts.size() <= i) {
+		auto fm = pango_cairo_font_map_new();
+		contexts.push_back(
+			xlua_document_setup_context(pango_font_map_create_context(fm)));
+		g_object_unref(fm);
+	}
+	pango_cairo_update_context(cr, contexts[i]);
+	return contexts[i];
+}
+
+/// Finishes the file, signing it if requested, returning an error message
+/// if it hasn't been written out successfully.
+static string xlua_document_finish(LuaDocument *self) {
+	if (!self->cr)
+		return "";
+
+	cairo_surface_finish(self->pdf);
+	string err;
+	if (auto status = cairo_surface_status(self->pdf))
+		err = cairo_status_to_string(status);
 	cairo_destroy(self->cr);
 	g_object_unref(self->pc);
+	self->cr = nullptr;
+	self->pdf = nullptr;
+	self->pc = nullptr;
+
+	string updates;
+#ifdef HAVE_PDF_SIMPLE_SIGN
+	if (err.empty() && self->signing()) {
+		pdf_sign_options options;
+		options.auto_reserve = true;
+		vector<const pdf_signer *> signers;
+		for (const auto &signer : self->signers)
+			signers.push_back(signer.get());
+		err = pdf_sign(self->pending.data(), self->pending.length(), updates,
+			*self->digest, signers, options);
+	}
+#endif
+	if (err.empty() && (fwrite(self->pending.data(), 1, self->pending.length(),
+		self->fp) != self->pending.length() || fwrite(updates.data(), 1,
+		updates.length(), self->fp) != updates.length()))
+		err = strerror(errno);
+	if (fclose(self->fp) && err.empty())
+		err = strerror(errno);
+
+	self->fp = nullptr;
+	string().swap(self->pending);
+	if (err.empty())
+		return err;
+
+	// Don't leave behind incomplete or unsigned documents.
+	if (self->regular)
+		(void) unlink(self->filename.c_str());
+	return self->filename + ": " + err;
+}
+
+static LuaDocument *xlua_document_check(lua_State *L, int arg) {
+	auto self =
+		(LuaDocument *) luaL_checkudata(L, arg, XLUA_DOCUMENT_METATABLE);
+	if (!self->cr)
+		luaL_error(L, "the document has already been closed");
+	return self;
+}
+
+static int xlua_document_gc(lua_State *L) {
+	auto self = (LuaDocument *) luaL_checkudata(L, 1, XLUA_DOCUMENT_METATABLE);
+	(void) xlua_document_finish(self);
+	self->~LuaDocument();
+	return 0;
+}
+
+static int xlua_document_close(lua_State *L) {
+	auto self = (LuaDocument *) luaL_checkudata(L, 1, XLUA_DOCUMENT_METATABLE);
+	if (auto err = xlua_document_finish(self); !err.empty())
+		return luaL_error(L, "%s", err.c_str());
 	return 0;
 }
 
@@ -711,7 +1053,7 @@ static optional<cairo_pdf_metadata_t> metadata_by_name(const char *name) {
 }
 
 static int xlua_document_newindex(lua_State *L) {
-	auto self = (LuaDocument *) luaL_checkudata(L, 1, XLUA_DOCUMENT_METATABLE);
+	auto self = xlua_document_check(L, 1);
 	auto name = luaL_checkstring(L, 2);
 	auto value = luaL_checkstring(L, 3);
 
@@ -724,7 +1066,8 @@ static int xlua_document_newindex(lua_State *L) {
 }
 
 static int xlua_document_show(lua_State *L) {
-	auto self = (LuaDocument *) luaL_checkudata(L, 1, XLUA_DOCUMENT_METATABLE);
+	auto self = xlua_document_check(L, 1);
+	self->started = true;
 	for (int i = 2; i <= lua_gettop(L); i++) {
 		auto w = (LuaWidget *) luaL_checkudata(L, i, XLUA_WIDGET_METATABLE);
 		xlua_widget_check(L, w);
@@ -744,11 +1087,132 @@ static int xlua_document_show(lua_State *L) {
 	return 0;
 }
 
+static int xlua_document_show_pages(lua_State *L) {
+	auto self = xlua_document_check(L, 1);
+	vector<Widget *> pages;
+	for (int i = 2; i <= lua_gettop(L); i++) {
+		auto w = (LuaWidget *) luaL_checkudata(L, i, XLUA_WIDGET_METATABLE);
+		xlua_widget_check(L, w);
+		auto widget = w->widget.get();
+		if (find(pages.begin(), pages.end(), widget) != pages.end())
+			return luaL_argerror(L, i, "widget shown more than once");
+
+		widget->apply_attributes();
+		pages.push_back(widget);
+	}
+
+	if (pages.empty())
+		return 0;
+	self->started = true;
+
+	// Laying out text is what takes the most time, and pages don't depend
+	// on each other.  Rendering stays serial, as there is only one surface,
+	// which also keeps font subsets shared by the whole document.
+	auto inner_width = self->page_width - 2 * self->page_margin;
+	auto inner_height = self->page_height - 2 * self->page_margin;
+	auto jobs = min<size_t>(pages.size(),
+		max(1u, thread::hardware_concurrency()));
+
+	vector<PangoContext *> contexts;
+	for (size_t i = 0; i < jobs; i++)
+		contexts.push_back(xlua_document_worker_context(self->cr, i));
+
+	// Exceptions mustn't escape threads, so stop all work at the first one,
+	// and only turn it into a Lua error once every thread has finished.
+	atomic<size_t> next{0};
+	vector<exception_ptr> errors(jobs);
+	auto work = [&](size_t i) {
+		try {
+			for (size_t page; (page = next++) < pages.size(); )
+				pages[page]->prepare_for_size(
+					contexts[i], inner_width, inner_height);
+		} catch (...) {
+			errors[i] = current_exception();
+			next = pages.size();
+		}
+	};
+
+	// Whatever threads fail to start, the remaining ones take over their work.
+	vector<thread> threads;
+	try {
+		for (size_t i = 1; i < jobs; i++)
+			threads.emplace_back(work, i);
+	} catch (const system_error &) {}
+	work(0);
+	for (auto &thread : threads)
+		thread.join();
+
+	string err;
+	for (const auto &error : errors) {
+		if (!error || !err.empty())
+			continue;
+		try {
+			rethrow_exception(error);
+		} catch (const exception &e) {
+			err = e.what();
+		} catch (...) {
+			err = "layout failed";
+		}
+	}
+	if (!err.empty())
+		return luaL_error(L, "%s", err.c_str());
+
+	for (auto widget : pages) {
+		cairo_save(self->cr);
+		cairo_translate(self->cr, self->page_margin, self->page_margin);
+		widget->render(self->cr, inner_width, inner_height);
+		cairo_restore(self->cr);
+		cairo_show_page(self->cr);
+	}
+	return 0;
+}
+
+#ifdef HAVE_PDF_SIMPLE_SIGN
+
+#define XLUA_SIGNER_METATABLE "signer"
+
+struct LuaSigner {
+	shared_ptr<pdf_key_signer> signer;  ///< Loaded key pair
+};
+
+static int xlua_signer_gc(lua_State *L) {
+	auto self = (LuaSigner *) luaL_checkudata(L, 1, XLUA_SIGNER_METATABLE);
+	self->~LuaSigner();
+	return 0;
+}
+
+static luaL_Reg xlua_signer_table[] = {
+	{"__gc",       xlua_signer_gc},
+	{}
+};
+
+static int xlua_document_sign(lua_State *L) {
+	auto self = xlua_document_check(L, 1);
+	auto signer = (LuaSigner *) luaL_checkudata(L, 2, XLUA_SIGNER_METATABLE);
+	if (self->started)
+		return luaL_error(L, "signatures must be requested before any pages");
+
+	// What has been held back so far is only the PDF header.
+	if (!self->digest)
+		self->digest = make_unique<pdf_digest>(
+			self->pending.data(), self->pending.length());
+	self->signers.push_back(signer->signer);
+	return 0;
+}
+
+#endif  // HAVE_PDF_SIMPLE_SIGN
+
 static luaL_Reg xlua_document_table[] = {
 	{"__gc",       xlua_document_gc},
+	{"__close",    xlua_document_close},
 	{"__index",    xlua_document_index},
 	{"__newindex", xlua_document_newindex},
 	{"show",       xlua_document_show},
+	{"show_pages", xlua_document_show_pages},
+	{"close",      xlua_document_close},
+#ifdef HAVE_PDF_SIMPLE_SIGN
+	{"sign",       xlua_document_sign},
+#endif
 	{}
 };
 
@@ -837,6 +1301,243 @@ static int xlua_escape(lua_State *L) {
 	return 1;
 }
 
+/// Pushes the values of a JSON document onto the Lua stack, so that data
+/// for documents can be passed in without having to write Lua.
+/// Rather than raising Lua errors mid-way, it records the first problem.
+struct JsonReader {
+	lua_State *L;
+	const char *p, *end;
+	const char *error = nullptr;
+
+	/// The Lua stack and the C stack both need to be bounded.
+	static constexpr int max_depth = 200;
+
+	bool fail(const char *message) {
+		if (!error)
+			error = message;
+		return false;
+	}
+
+	void skip() {
+		while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+			p++;
+	}
+
+	bool literal(const char *word) {
+		auto len = strlen(word);
+		if (size_t(end - p) < len || strncmp(p, word, len))
+			return fail("invalid literal");
+		p += len;
+		return true;
+	}
+
+	bool hex4(unsigned &out) {
+		if (end - p < 4)
+			return fail("truncated escape");
+		out = 0;
+		for (int i = 0; i < 4; i++, p++) {
+			out <<= 4;
+			if (*p >= '0' && *p <= '9')
+				out |= *p - '0';
+			else if (*p >= 'a' && *p <= 'f')
+				out |= *p - 'a' + 10;
+			else if (*p >= 'A' && *p <= 'F')
+				out |= *p - 'A' + 10;
+			else
+				return fail("invalid escape");
+		}
+		return true;
+	}
+
+	static void append_utf8(string &out, unsigned c) {
+		if (c < 0x80) {
+			out += char(c);
+		} else if (c < 0x800) {
+			out += char(0xc0 | c >> 6);
+			out += char(0x80 | (c & 0x3f));
+		} else if (c < 0x10000) {
+			out += char(0xe0 | c >> 12);
+			out += char(0x80 | (c >> 6 & 0x3f));
+			out += char(0x80 | (c & 0x3f));
+		} else {
+			out += char(0xf0 | c >> 18);
+			out += char(0x80 | (c >> 12 & 0x3f));
+			out += char(0x80 | (c >> 6 & 0x3f));
+			out += char(0x80 | (c & 0x3f));
+		}
+	}
+
+	bool escape(string &out) {
+		if (p == end)
+			return fail("truncated escape");
+		switch (*p++) {
+		case '"':  out += '"';  return true;
+		case '\\': out += '\\'; return true;
+		case '/':  out += '/';  return true;
+		case 'b':  out += '\b'; return true;
+		case 'f':  out += '\f'; return true;
+		case 'n':  out += '\n'; return true;
+		case 'r':  out += '\r'; return true;
+		case 't':  out += '\t'; return true;
+		case 'u':  break;
+		default:   return fail("invalid escape");
+		}
+
+		unsigned c = 0, low = 0;
+		if (!hex4(c))
+			return false;
+		if (c >= 0xdc00 && c <= 0xdfff)
+			return fail("unpaired surrogate");
+		if (c >= 0xd800 && c <= 0xdbff) {
+			if (end - p < 2 || p[0] != '\\' || p[1] != 'u')
+				return fail("unpaired surrogate");
+			p += 2;
+			if (!hex4(low))
+				return false;
+			if (low < 0xdc00 || low > 0xdfff)
+				return fail("unpaired surrogate");
+			c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+		}
+		append_utf8(out, c);
+		return true;
+	}
+
+	bool string_value(string &out) {
+		if (p == end || *p != '"')
+			return fail("string expected");
+		for (p++; p < end; ) {
+			if (*p == '"') {
+				p++;
+				return true;
+			}
+			if ((unsigned char) *p < 0x20)
+				return fail("control character in a string");
+			if (*p != '\\')
+				out += *p++;
+			else if (p++, !escape(out))
+				return false;
+		}
+		return fail("unterminated string");
+	}
+
+	bool number() {
+		auto digits = [&] {
+			auto start = p;
+			while (p < end && *p >= '0' && *p <= '9')
+				p++;
+			return p != start;
+		};
+
+		auto start = p;
+		if (p < end && *p == '-')
+			p++;
+		if (p < end && *p == '0')
+			p++;
+		else if (!digits())
+			return fail("invalid number");
+		if (p < end && *p == '.' && (p++, !digits()))
+			return fail("invalid number");
+		if (p < end && (*p == 'e' || *p == 'E')) {
+			if (++p < end && (*p == '+' || *p == '-'))
+				p++;
+			if (!digits())
+				return fail("invalid number");
+		}
+
+		// Lua decides on its own whether it's an integer or a float.
+		if (!lua_stringtonumber(L, string(start, p).c_str()))
+			return fail("invalid number");
+		return true;
+	}
+
+	bool object(int depth) {
+		lua_newtable(L);
+		if (skip(), p < end && *p == '}')
+			return p++, true;
+		while (true) {
+			string key;
+			if (skip(), !string_value(key))
+				return false;
+			if (skip(), p == end || *p++ != ':')
+				return fail("colon expected");
+
+			lua_pushlstring(L, key.data(), key.length());
+			if (!value(depth + 1))
+				return false;
+			lua_rawset(L, -3);
+
+			if (skip(), p < end && *p == ',')
+				p++;
+			else if (p < end && *p == '}')
+				return p++, true;
+			else
+				return fail("comma or closing brace expected");
+		}
+	}
+
+	bool array(int depth) {
+		lua_newtable(L);
+		if (skip(), p < end && *p == ']')
+			return p++, true;
+		for (lua_Integer i = 1; ; i++) {
+			if (!value(depth + 1))
+				return false;
+			lua_rawseti(L, -2, i);
+
+			if (skip(), p < end && *p == ',')
+				p++;
+			else if (p < end && *p == ']')
+				return p++, true;
+			else
+				return fail("comma or closing bracket expected");
+		}
+	}
+
+	bool value(int depth) {
+		if (depth > max_depth || !lua_checkstack(L, 3))
+			return fail("nested too deeply");
+		if (skip(), p == end)
+			return fail("unexpected end of input");
+
+		string s;
+		switch (*p) {
+		case '{':
+			return p++, object(depth);
+		case '[':
+			return p++, array(depth);
+		case '"':
+			if (!string_value(s))
+				return false;
+			lua_pushlstring(L, s.data(), s.length());
+			return true;
+		case 't':
+			lua_pushboolean(L, true);
+			return literal("true");
+		case 'f':
+			lua_pushboolean(L, false);
+			return literal("false");
+		case 'n':
+			// This makes null values simply missing from tables.
+			lua_pushnil(L);
+			return literal("null");
+		default:
+			return number();
+		}
+	}
+};
+
+static int xlua_json(lua_State *L) {
+	size_t len = 0;
+	const char *s = luaL_checklstring(L, 1, &len);
+	JsonReader reader{L, s, s + len};
+	if (reader.value(0) && (reader.skip(), reader.p != reader.end))
+		reader.fail("trailing data");
+	if (reader.error)
+		return luaL_error(L, "JSON: %s at offset %d",
+			reader.error, int(reader.p - s));
+	return 1;
+}
+
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
 static int xlua_document(lua_State *L) {
@@ -849,26 +1550,44 @@ static int xlua_document(lua_State *L) {
 	luaL_setmetatable(L, XLUA_DOCUMENT_METATABLE);
 	new(self) LuaDocument;
 
-	self->pdf = cairo_pdf_surface_create(filename,
+	self->filename = filename;
+	if (!(self->fp = fopen(filename, "wb")))
+		return luaL_error(L, "%s: %s", filename, strerror(errno));
+	struct stat st = {};
+	self->regular = !fstat(fileno(self->fp), &st) && S_ISREG(st.st_mode);
+
+	self->pdf = cairo_pdf_surface_create_for_stream(xlua_document_write, self,
 		(self->page_width = width), (self->page_height = height));
 	self->cr = cairo_create(self->pdf);
 	cairo_surface_destroy(self->pdf);
 
 	self->page_margin = luaL_optnumber(L, 4, self->page_margin);
+	self->pc = xlua_document_context(self->cr);
+	return 1;
+}
 
-	auto pc = self->pc = pango_cairo_create_context(self->cr);
-	// By default the resolution is set to 96 DPI but the PDF surface uses 72.
-	pango_cairo_context_set_resolution(pc, 72.);
+#ifdef HAVE_PDF_SIMPLE_SIGN
 
-#if PANGO_VERSION_CHECK(1, 44, 0)
-	// Otherwise kerning was broken in Pango before 1.48.6.
-	// Seems like this issue: https://gitlab.gnome.org/GNOME/pango/-/issues/562
-	// and might be related to: https://blogs.gnome.org/mclasen/2019/08/
-	pango_context_set_round_glyph_positions(pc, FALSE);
-#endif
+static int xlua_signer(lua_State *L) {
+	const char *path = luaL_checkstring(L, 1);
+	const char *pass = luaL_optstring(L, 2, "");
+
+	LuaSigner *self =
+		static_cast<LuaSigner *>(lua_newuserdata(L, sizeof *self));
+	luaL_setmetatable(L, XLUA_SIGNER_METATABLE);
+	new(self) LuaSigner;
+
+	self->signer = make_shared<pdf_key_signer>();
+	auto err = is_uri(path)
+		? self->signer->load_store(path, pass)
+		: self->signer->load_pkcs12(path, pass);
+	if (!err.empty())
+		return luaL_error(L, "%s", err.c_str());
 	return 1;
 }
 
+#endif  // HAVE_PDF_SIMPLE_SIGN
+
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
 static LuaWidget *xlua_newwidget(lua_State *L) {
@@ -1057,8 +1776,12 @@ static luaL_Reg xlua_library[] = {
 	{"cm",       xlua_cm},
 	{"ntoa",     xlua_ntoa},
 	{"escape",   xlua_escape},
+	{"json",     xlua_json},
 
 	{"Document", xlua_document},
+#ifdef HAVE_PDF_SIMPLE_SIGN
+	{"Signer",   xlua_signer},
+#endif
 
 	{"Filler",   xlua_filler},
 	{"HLine",    xlua_hline},
@@ -1130,6 +1853,12 @@ int main(int argc, char *argv[]) {
 	luaL_setfuncs(L, xlua_widget_table, 0);
 	lua_pop(L, 1);
 
+#ifdef HAVE_PDF_SIMPLE_SIGN
+	luaL_newmetatable(L, XLUA_SIGNER_METATABLE);
+	luaL_setfuncs(L, xlua_signer_table, 0);
+	lua_pop(L, 1);
+#endif
+
 	luaL_checkstack(L, argc, NULL);
 
 	// Joining the first two might make a tiny bit more sense.
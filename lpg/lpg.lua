@@ -79,6 +79,14 @@ local page1 = lpg.VBox {fontfamily="sans serif", fontsize=12.,
 			"all text within <b>lpg</b> is parsed as Pango markup, " ..
 			"which is a subset of XML.")),
 
+	define("lpg.json (string)",
+		p("Decodes a JSON document into Lua values, " ..
+			"with <tt>null</tt> turning into <b>nil</b>.  " ..
+			"This makes it easy to render a whole batch of documents " ..
+			"from lines of data, such as by iterating over " ..
+			"<tt>io.lines()</tt>, while fonts, text layouts, " ..
+			"and pictures are only loaded once.")),
+
 	h3("PDF documents"),
 
 	define("lpg.Document (filename, width, height [, margin])",
@@ -86,7 +94,9 @@ local page1 = lpg.VBox {fontfamily="sans serif", fontsize=12.,
 			"the same size in 72 DPI points, as specified by <b>width</b> " ..
 			"and <b>height</b>.  The <b>margin</b> is used by <b>show</b> " ..
 			"on all sides of pages."),
-		p("The file is finalized when the object is garbage collected.")),
+		p("The file is finalized when the object is garbage collected, " ..
+			"goes out of scope as a to-be-closed variable, " ..
+			"or is closed explicitly.")),
 
 	define("<i>Document</i>.title, author, subject, keywords, " ..
 		"creator, create_date, mod_date",
@@ -96,6 +106,30 @@ local page1 = lpg.VBox {fontfamily="sans serif", fontsize=12.,
 		p("Starts a new document page, and renders <i>Widget</i> trees over " ..
 		"the whole print area.")),
 
+	define("<i>Document</i>:show_pages ([widget...])",
+		p("Shows each <i>Widget</i> tree on a page of its own, " ..
+		"laying them out in parallel, which is faster for long documents.  " ..
+		"The final rendering still happens in order.")),
+
+	define("<i>Document</i>:sign (signer)",
+		p("Adds a signature by the given <i>Signer</i> to the file " ..
+		"once it is finished, which must be requested before showing " ..
+		"any pages.  Signed documents are held in memory until then, " ..
+		"and never need to be read back.  It may be called repeatedly, " ..
+		"each signature also covering the preceding ones.")),
+
+	define("lpg.Signer (key-pair [, password])",
+		p("Returns a new <i>Signer</i> object for a PKCS#12 file " ..
+		"or an OSSL_STORE URI, same as with <b>pdf-simple-sign</b>.  " ..
+		"This is only available when <b>lpg</b> has been built with it.")),
+
+	define("<i>Document</i>:close ()",
+		p("Finishes writing out the file, raising an error on failure, " ..
+		"in which case the file is removed.  " ..
+		"The object may not be used any further."),
+		p("Only this and to-be-closed variables report errors, " ..
+		"garbage collection has no way to.")),
+
 	lpg.Filler {},
 }
 
@@ -234,7 +268,6 @@ for i = 1, #arg do
 	pdf.author = "Přemysl Eric Janouch"
 	pdf.creator = ("lpg (%s)"):format(project_url)
 
-	pdf:show(page1)
-	pdf:show(page2)
-	pdf:show(page3)
+	pdf:show_pages(page1, page2, page3)
+	pdf:close()
 end
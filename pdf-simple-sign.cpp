@@ -17,42 +17,64 @@
 //
 
 #include <cmath>
+#include <cstddef>
 #include <cstdio>
+#include <cstring>
 #undef NDEBUG
 #include <cassert>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <list>
 #include <map>
 #include <memory>
-#include <regex>
+#include <mutex>
 #include <set>
+#include <thread>
+#include <tuple>
 #include <vector>
 
-#if defined __GLIBCXX__ && __GLIBCXX__ < 20140422
-#error Need libstdc++ >= 4.9 for <regex>
-#endif
-
+#include <fcntl.h>
 #include <getopt.h>
+#include <netdb.h>
 #include <openssl/err.h>
+#include <openssl/pem.h>
 #include <openssl/pkcs12.h>
+#include <openssl/store.h>
+#include <openssl/ts.h>
+#include <openssl/ui.h>
 #include <openssl/x509v3.h>
+#include <climits>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <unistd.h>
+#include <zlib.h>
 
 #include "config.h"
+#ifdef HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define PDF_PROBE1(name, arg) DTRACE_PROBE1(pdf_simple_sign, name, arg)
+#else
+#define PDF_PROBE1(name, arg)
+#endif
 
 // -------------------------------------------------------------------------------------------------
 
 using uint = unsigned int;
 using ushort = unsigned short;
 
-static std::string concatenate(const std::vector<std::string>& v, const std::string& delim) {
-  std::string res;
-  if (v.empty())
-    return res;
-  for (const auto& s : v)
-    res += s + delim;
-  return res.substr(0, res.length() - delim.length());
-}
-
 template<typename... Args>
 std::string ssprintf(const std::string& format, Args... args) {
   size_t size = std::snprintf(nullptr, 0, format.c_str(), args...) + 1;
@@ -63,46 +85,319 @@ std::string ssprintf(const std::string& format, Args... args) {
 
 // -------------------------------------------------------------------------------------------------
 
+/// Timings and counters of the work done on a document, only collected on request.
+/// For its lifetime, an active instance becomes the current one of the thread that has created it.
+/// Work done in other threads is recorded through an instance handed over explicitly.
+class pdf_stats {
+public:
+  enum phase {
+    KEYS, READ, HASH, XREF, PAGES, UPDATE, DIGEST, SIGN, TIMESTAMP, WRITE, VERIFY, PHASE_COUNT
+  };
+  enum counter {
+    BYTES_HASHED, DIGEST_CACHE_HITS, XREF_SECTIONS, OBJECTS_PARSED, OBJECT_CACHE_HITS,
+    STREAMS_DECODED, STREAM_CACHE_HITS, ARENA_BLOCKS, ARENA_BYTES, COUNTER_COUNT
+  };
+
+  static const char* phase_names[PHASE_COUNT];
+  static const char* counter_names[COUNTER_COUNT];
+
+  uint64_t nanoseconds[PHASE_COUNT] = {};  ///< Total time spent in each phase
+  uint64_t counters[COUNTER_COUNT] = {};   ///< Values of all counters
+
+  explicit pdf_stats(bool active = true) : active(active), previous(current) {
+    if (active)
+      current = this;
+  }
+  pdf_stats(const pdf_stats&) = delete;
+  pdf_stats& operator=(const pdf_stats&) = delete;
+  ~pdf_stats() {
+    if (active)
+      current = previous;
+  }
+
+  /// The innermost active instance of this thread, or nullptr if there is none
+  static thread_local pdf_stats* current;
+
+  /// Increase a counter, if there is any instance to speak of
+  static void count(counter which, uint64_t n = 1, pdf_stats* stats = current) {
+    if (stats)
+      stats->counters[which] += n;
+  }
+
+  /// Measures the time spent within its scope as a phase, if there is any instance to record it in.
+  /// Phases are also marked with USDT probes, where available.
+  class timer {
+    phase which;
+    pdf_stats* stats;
+    std::chrono::steady_clock::time_point start;
+
+  public:
+    explicit timer(phase which, pdf_stats* stats = current) : which(which), stats(stats) {
+      PDF_PROBE1(phase__begin, phase_names[which]);
+      if (stats)
+        start = std::chrono::steady_clock::now();
+    }
+    ~timer() {
+      if (stats)
+        stats->nanoseconds[which] += std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now() - start).count();
+      PDF_PROBE1(phase__end, phase_names[which]);
+    }
+  };
+
+  /// Format all values as members of a JSON object, without the braces
+  std::string json() const;
+  /// Format all values as human-readable lines
+  std::string summary() const;
+
+private:
+  bool active;           ///< Whether this is or has been the current instance
+  pdf_stats* previous;   ///< The instance current before this one
+};
+
+thread_local pdf_stats* pdf_stats::current;
+
+const char* pdf_stats::phase_names[PHASE_COUNT] = {
+  "keys", "read", "hash", "xref", "pages", "update", "digest", "sign", "timestamp", "write",
+  "verify",
+};
+const char* pdf_stats::counter_names[COUNTER_COUNT] = {
+  "bytes_hashed", "digest_cache_hits", "xref_sections", "objects_parsed", "object_cache_hits",
+  "streams_decoded", "stream_cache_hits", "arena_blocks", "arena_bytes",
+};
+
+std::string pdf_stats::json() const {
+  std::string out;
+  for (size_t i = 0; i < PHASE_COUNT; i++)
+    out += ssprintf("%s\"%s\": %.6f", i ? ", " : "", phase_names[i], nanoseconds[i] / 1e9);
+  for (size_t i = 0; i < COUNTER_COUNT; i++)
+    out += ssprintf(", \"%s\": %llu", counter_names[i], (unsigned long long) counters[i]);
+  return out;
+}
+
+std::string pdf_stats::summary() const {
+  std::string out;
+  for (size_t i = 0; i < PHASE_COUNT; i++)
+    out += ssprintf("%-20s %12.6f s\n", phase_names[i], nanoseconds[i] / 1e9);
+  for (size_t i = 0; i < COUNTER_COUNT; i++)
+    out += ssprintf("%-20s %12llu\n", counter_names[i], (unsigned long long) counters[i]);
+  return out;
+}
+
+/// Escape a string for inclusion in JSON output
+static std::string json_string(const std::string& s) {
+  std::string out = "\"";
+  for (unsigned char c : s) {
+    if (c == '"' || c == '\\')
+      out += '\\', out += c;
+    else if (c < 0x20)
+      out += ssprintf("\\u%04x", c);
+    else
+      out += c;
+  }
+  return out + "\"";
+}
+
+// -------------------------------------------------------------------------------------------------
+
+/// Monotonic memory arena, to save on the many small allocations made by parse trees.
+/// Memory is handed out sequentially and only released all at once, when the arena is destroyed.
+/// For its lifetime, the arena becomes the current one of the thread that has created it.
+class pdf_arena {
+public:
+  pdf_arena() : previous(current) { current = this; }
+  pdf_arena(const pdf_arena&) = delete;
+  pdf_arena& operator=(const pdf_arena&) = delete;
+  ~pdf_arena() { current = previous; }
+
+  /// Return a block of memory suitably aligned for any object type
+  void* allocate(size_t size);
+
+  /// The innermost arena of this thread, or nullptr if there is none
+  static thread_local pdf_arena* current;
+
+private:
+  enum { BLOCK_SIZE = 64 << 10 };
+
+  pdf_arena* previous;                          ///< The arena current before this one
+  std::vector<std::unique_ptr<char[]>> blocks;  ///< All memory owned by the arena
+  char* p = nullptr;                            ///< Start of free space in the last block
+  char* end = nullptr;                          ///< End of the last block
+};
+
+thread_local pdf_arena* pdf_arena::current;
+
+void* pdf_arena::allocate(size_t size) {
+  const size_t alignment = alignof(std::max_align_t);
+  size = (size + alignment - 1) & ~(alignment - 1);
+  if (size > size_t(end - p)) {
+    // Large requests get a block of their own, so as not to waste the rest of the current one
+    if (size > BLOCK_SIZE / 4) {
+      pdf_stats::count(pdf_stats::ARENA_BLOCKS);
+      pdf_stats::count(pdf_stats::ARENA_BYTES, size);
+      blocks.emplace_back(new char[size]);
+      return blocks.back().get();
+    }
+    pdf_stats::count(pdf_stats::ARENA_BLOCKS);
+    pdf_stats::count(pdf_stats::ARENA_BYTES, BLOCK_SIZE);
+    blocks.emplace_back(new char[BLOCK_SIZE]);
+    p = blocks.back().get();
+    end = p + BLOCK_SIZE;
+  }
+  auto result = p;
+  p += size;
+  return result;
+}
+
+/// Container allocator that draws memory from the current arena of the thread, or from the heap
+/// if there is none.  It is stateless, so as not to make containers any larger: containers
+/// must therefore be both created and destroyed either within the same arena's lifetime,
+/// or outside of any arena, and they must stay within their thread.
+template<typename T> struct pdf_allocator {
+  using value_type = T;
+
+  pdf_allocator() {}
+  template<typename U> pdf_allocator(const pdf_allocator<U>&) {}
+
+  T* allocate(size_t n) {
+    if (auto arena = pdf_arena::current)
+      return static_cast<T*>(arena->allocate(n * sizeof(T)));
+    return static_cast<T*>(::operator new(n * sizeof(T)));
+  }
+  void deallocate(T* p, size_t) {
+    if (!pdf_arena::current)
+      ::operator delete(p);
+  }
+};
+
+template<typename T, typename U>
+bool operator==(const pdf_allocator<T>&, const pdf_allocator<U>&) { return true; }
+template<typename T, typename U>
+bool operator!=(const pdf_allocator<T>&, const pdf_allocator<U>&) { return false; }
+
+// -------------------------------------------------------------------------------------------------
+
+/// Dictionary with a std::map-like interface, stored as a flat vector of pairs sorted by key.
+/// PDF dictionaries tend to be small, making this cheaper on memory, allocations and cache misses.
+/// It is a template only so that it can be used with the incomplete pdf_object type.
+template<typename T> class pdf_flat_map {
+public:
+  using value_type = std::pair<std::string, T>;
+  using storage = std::vector<value_type, pdf_allocator<value_type>>;
+  using iterator = typename storage::iterator;
+  using const_iterator = typename storage::const_iterator;
+
+  pdf_flat_map() {}
+  pdf_flat_map(std::initializer_list<value_type> pairs) : pdf_flat_map(storage(pairs)) {}
+
+  /// Sort the pairs by key, keeping only the first occurrence of each, as std::map::insert would
+  explicit pdf_flat_map(storage pairs) : items(std::move(pairs)) {
+    std::stable_sort(items.begin(), items.end(),
+      [](const value_type& a, const value_type& b) { return a.first < b.first; });
+    items.erase(std::unique(items.begin(), items.end(),
+      [](const value_type& a, const value_type& b) { return a.first == b.first; }), items.end());
+  }
+
+  iterator begin()             { return items.begin(); }
+  iterator end()               { return items.end(); }
+  const_iterator begin() const { return items.begin(); }
+  const_iterator end() const   { return items.end(); }
+  size_t size() const          { return items.size(); }
+  bool empty() const           { return items.empty(); }
+
+  iterator find(const std::string& key) {
+    auto i = lower_bound(key);
+    return (i != items.end() && i->first == key) ? i : items.end();
+  }
+  const_iterator find(const std::string& key) const {
+    return const_cast<pdf_flat_map*>(this)->find(key);
+  }
+  size_t count(const std::string& key) const { return find(key) != end(); }
+
+  std::pair<iterator, bool> insert(value_type pair) {
+    auto i = lower_bound(pair.first);
+    if (i != items.end() && i->first == pair.first)
+      return {i, false};
+    return {items.insert(i, std::move(pair)), true};
+  }
+  T& operator[](const std::string& key) {
+    return insert({key, T()}).first->second;
+  }
+  size_t erase(const std::string& key) {
+    auto i = find(key);
+    if (i == items.end())
+      return 0;
+    items.erase(i);
+    return 1;
+  }
+
+private:
+  storage items;  ///< Sorted by key, which are unique
+
+  iterator lower_bound(const std::string& key) {
+    return std::lower_bound(items.begin(), items.end(), key,
+      [](const value_type& a, const std::string& key) { return a.first < key; });
+  }
+};
+
+struct pdf_object;
+using pdf_array = std::vector<pdf_object, pdf_allocator<pdf_object>>;
+using pdf_dict = pdf_flat_map<pdf_object>;
+
 /// PDF token/object thingy.  Objects may be composed either from one or a sequence of tokens.
 /// The PDF Reference doesn't actually speak of tokens, though ISO 32000-1:2008 does.
 struct pdf_object {
-  enum type {
+  enum type : unsigned char {
     END, NL, COMMENT, NIL, BOOL, NUMERIC, KEYWORD, NAME, STRING,
     // Simple tokens
     B_ARRAY, E_ARRAY, B_DICT, E_DICT,
     // Higher-level objects
-    ARRAY, DICT, OBJECT, REFERENCE,
+    ARRAY, DICT, OBJECT, REFERENCE, STREAM,
   } type = END;
 
-  std::string string;                      ///< END (error message), COMMENT/KEYWORD/NAME/STRING
-  double number = 0.;                      ///< BOOL, NUMERIC
-  std::vector<pdf_object> array;           ///< ARRAY, OBJECT
-  std::map<std::string, pdf_object> dict;  ///< DICT, in the future also STREAM
   uint n = 0, generation = 0;              ///< OBJECT, REFERENCE
+  double number = 0.;                      ///< BOOL, NUMERIC
+  std::string string;                      ///< END (error message), COMMENT/KEYWORD/NAME/STRING,
+                                           ///< STREAM (raw data)
+  pdf_array array;                         ///< ARRAY, OBJECT
+  pdf_dict dict;                           ///< DICT, STREAM
 
   pdf_object(enum type type = END)                          : type(type) {}
   pdf_object(enum type type, double v)                      : type(type), number(v) {}
-  pdf_object(enum type type, const std::string& v)          : type(type), string(v) {}
+  pdf_object(enum type type, std::string v)                 : type(type), string(std::move(v)) {}
   pdf_object(enum type type, uint n, uint g)                : type(type), n(n), generation(g) {}
-  pdf_object(const std::vector<pdf_object>& array)          : type(ARRAY), array(array) {}
-  pdf_object(const std::map<std::string, pdf_object>& dict) : type(DICT), dict(dict) {}
+  pdf_object(pdf_array array)                               : type(ARRAY), array(std::move(array)) {}
+  pdf_object(pdf_dict dict)                                 : type(DICT), dict(std::move(dict)) {}
 
   pdf_object(const pdf_object&)            = default;
   pdf_object(pdf_object&&)                 = default;
   pdf_object& operator=(const pdf_object&) = default;
   pdf_object& operator=(pdf_object&&)      = default;
 
+  /// Doubles represent all integers below this exactly, and the lexer parses them exactly
+  static constexpr uint64_t exact_limit = uint64_t(1) << 53;
+
   /// Return whether this is a number without a fractional part
   bool is_integer() const {
     double tmp;
     return type == NUMERIC && std::modf(number, &tmp) == 0.;
   }
+
+  /// Retrieve a non-negative integer no larger than `limit', such as an offset or a length,
+  /// and fail for anything that might not be the exact value written in the document
+  bool get_unsigned(uint64_t& value, uint64_t limit = exact_limit - 1) const {
+    if (!is_integer() || number < 0 || number >= double(exact_limit) || number > double(limit))
+      return false;
+    value = uint64_t(number);
+    return true;
+  }
 };
 
 /// Basic lexical analyser for the Portable Document Format, giving limited error information
 struct pdf_lexer {
-  const unsigned char* p;
-  pdf_lexer(const char* s) : p(reinterpret_cast<const unsigned char*>(s)) {}
+  const unsigned char* p, * end;
+  pdf_lexer(const char* s, const char* end)
+    : p(reinterpret_cast<const unsigned char*>(s)), end(reinterpret_cast<const unsigned char*>(end)) {}
 
   static constexpr const char* oct_alphabet = "01234567";
   static constexpr const char* dec_alphabet = "0123456789";
@@ -110,25 +405,52 @@ struct pdf_lexer {
   static constexpr const char* whitespace = "\t\n\f\r ";
   static constexpr const char* delimiters = "()<>[]{}/%";
 
+  /// Return the current character, or NUL at the end of input, as with C strings
+  int peek() const { return p < end ? *p : 0; }
+
   bool eat_newline(int ch) {
     if (ch == '\r') {
-      if (*p == '\n') p++;
+      if (peek() == '\n') p++;
       return true;
     }
     return ch == '\n';
   }
 
+  static int hex_value(int ch) {
+    if (ch >= '0' && ch <= '9') return ch - '0';
+    if (ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+    if (ch >= 'A' && ch <= 'F') return ch - 'A' + 10;
+    return -1;
+  }
+
+  /// Whether the character terminates regular tokens, which includes the end of input
+  static bool is_boundary(int ch) {
+    return !ch || strchr(whitespace, ch) || strchr(delimiters, ch);
+  }
+
   pdf_object string() {
-    std::string value;
+    // Most strings contain neither escapes nor newlines to normalize, and can be taken verbatim
+    auto start = p;
     int parens = 1;
+    for (auto q = p; q < end && *q && *q != '\\' && *q != '\r'; q++) {
+      if (*q == '(') {
+        parens++;
+      } else if (*q == ')' && !--parens) {
+        p = q + 1;
+        return {pdf_object::STRING, std::string(start, q)};
+      }
+    }
+
+    std::string value;
+    parens = 1;
     while (1) {
-      if (!*p) return {pdf_object::END, "unexpected end of string"};
+      if (!peek()) return {pdf_object::END, "unexpected end of string"};
       auto ch = *p++;
       if (eat_newline(ch)) ch = '\n';
       else if (ch == '(') { parens++; }
       else if (ch == ')') { if (!--parens) break; }
       else if (ch == '\\') {
-        if (!*p) return {pdf_object::END, "unexpected end of string"};
+        if (!peek()) return {pdf_object::END, "unexpected end of string"};
         switch ((ch = *p++)) {
         case 'n': ch = '\n'; break;
         case 'r': ch = '\r'; break;
@@ -138,12 +460,10 @@ struct pdf_lexer {
         default:
           if (eat_newline(ch))
             continue;
-          std::string octal;
           if (ch && strchr(oct_alphabet, ch)) {
-            octal += ch;
-            if (*p && strchr(oct_alphabet, *p)) octal += *p++;
-            if (*p && strchr(oct_alphabet, *p)) octal += *p++;
-            ch = std::stoi(octal, nullptr, 8);
+            ch -= '0';
+            if (peek() && strchr(oct_alphabet, peek())) ch = ch * 8 + (*p++ - '0');
+            if (peek() && strchr(oct_alphabet, peek())) ch = ch * 8 + (*p++ - '0');
           }
         }
       }
@@ -153,81 +473,103 @@ struct pdf_lexer {
   }
 
   pdf_object string_hex() {
-    std::string value, buf;
-    while (*p != '>') {
-      if (!*p) return {pdf_object::END, "unexpected end of hex string"};
-      if (!strchr(hex_alphabet, *p))
+    std::string value;
+    int high = -1, nibble;
+    while (peek() != '>') {
+      if (!peek()) return {pdf_object::END, "unexpected end of hex string"};
+      if ((nibble = hex_value(*p)) < 0)
         return {pdf_object::END, "invalid hex string"};
-      buf += *p++;
-      if (buf.size() == 2) {
-        value += char(std::stoi(buf, nullptr, 16));
-        buf.clear();
+      p++;
+      if (high < 0) {
+        high = nibble;
+      } else {
+        value += char(high << 4 | nibble);
+        high = -1;
       }
     }
     p++;
-    if (!buf.empty()) value += char(std::stoi(buf + '0', nullptr, 16));
+    if (high >= 0) value += char(high << 4);
     return {pdf_object::STRING, value};
   }
 
   pdf_object name() {
-    std::string value;
-    while (!strchr(whitespace, *p) && !strchr(delimiters, *p)) {
+    auto start = p;
+    while (!is_boundary(peek()) && *p != '#')
+      p++;
+    if (is_boundary(peek())) {
+      if (p == start) return {pdf_object::END, "unexpected end of name"};
+      return {pdf_object::NAME, std::string(start, p)};
+    }
+
+    // Only names with escapes need to be decoded character by character
+    std::string value(start, p);
+    while (!is_boundary(peek())) {
       auto ch = *p++;
       if (ch == '#') {
-        std::string hexa;
-        if (*p && strchr(hex_alphabet, *p)) hexa += *p++;
-        if (*p && strchr(hex_alphabet, *p)) hexa += *p++;
-        if (hexa.size() != 2)
+        int high = hex_value(peek()) < 0 ? -1 : hex_value(*p++);
+        int low = high < 0 || hex_value(peek()) < 0 ? -1 : hex_value(*p++);
+        if (low < 0)
           return {pdf_object::END, "invalid name hexa escape"};
-        ch = char(std::stoi(hexa, nullptr, 16));
+        ch = high << 4 | low;
       }
       value += ch;
     }
-    if (value.empty()) return {pdf_object::END, "unexpected end of name"};
     return {pdf_object::NAME, value};
   }
 
   pdf_object comment() {
-    std::string value;
-    while (*p && *p != '\r' && *p != '\n')
-      value += *p++;
-    return {pdf_object::COMMENT, value};
+    auto start = p;
+    while (peek() && *p != '\r' && *p != '\n')
+      p++;
+    return {pdf_object::COMMENT, std::string(start, p)};
   }
 
   // XXX maybe invalid numbers should rather be interpreted as keywords
   pdf_object number() {
-    std::string value;
-    if (*p == '-')
-      value += *p++;
-    bool real = false, digits = false;
-    while (*p) {
-      if (strchr(dec_alphabet, *p))
-        digits = true;
+    auto start = p;
+    bool negative = peek() == '-';
+    if (negative)
+      p++;
+
+    // Integers, such as all offsets, are by far the most common, and are parsed here exactly
+    uint64_t integer = 0;
+    auto digits = p;
+    while (p < end && *p >= '0' && *p <= '9' && integer < (uint64_t(1) << 53) / 10)
+      integer = integer * 10 + (*p++ - '0');
+    if (p != digits && !(p < end && ((*p >= '0' && *p <= '9') || *p == '.')))
+      return {pdf_object::NUMERIC, negative ? -double(integer) : double(integer)};
+
+    bool real = false, has_digits = false;
+    for (p = digits; p < end; p++) {
+      if (*p >= '0' && *p <= '9')
+        has_digits = true;
       else if (*p == '.' && !real)
         real = true;
       else
         break;
-      value += *p++;
     }
-    if (!digits) return {pdf_object::END, "invalid number"};
-    return {pdf_object::NUMERIC, std::stod(value, nullptr)};
+    if (!has_digits) return {pdf_object::END, "invalid number"};
+    return {pdf_object::NUMERIC, std::stod(std::string(start, p), nullptr)};
   }
 
   pdf_object next() {
-    if (!*p)
+    if (!peek())
       return {pdf_object::END};
-    if (strchr("-0123456789.", *p))
+    if (strchr("-0123456789.", peek()))
       return number();
 
     // {} end up being keywords, we might want to error out on those
-    std::string value;
-    while (!strchr(whitespace, *p) && !strchr(delimiters, *p))
-      value += *p++;
-    if (!value.empty()) {
-      if (value == "null")  return {pdf_object::NIL};
-      if (value == "true")  return {pdf_object::BOOL, 1};
-      if (value == "false") return {pdf_object::BOOL, 0};
-      return {pdf_object::KEYWORD, value};
+    auto start = p;
+    while (!is_boundary(peek()))
+      p++;
+    if (auto len = p - start) {
+      auto is = [&](const char* keyword) {
+        return size_t(len) == strlen(keyword) && !memcmp(start, keyword, len);
+      };
+      if (is("null"))  return {pdf_object::NIL};
+      if (is("true"))  return {pdf_object::BOOL, 1};
+      if (is("false")) return {pdf_object::BOOL, 0};
+      return {pdf_object::KEYWORD, std::string(start, p)};
     }
 
     switch (char ch = *p++) {
@@ -237,15 +579,15 @@ struct pdf_lexer {
     case '[': return {pdf_object::B_ARRAY};
     case ']': return {pdf_object::E_ARRAY};
     case '<':
-      if (*p++ == '<')
-        return {pdf_object::B_DICT};
-      p--;
-      return string_hex();
+      if (peek() != '<')
+        return string_hex();
+      p++;
+      return {pdf_object::B_DICT};
     case '>':
-      if (*p++ == '>')
-        return {pdf_object::E_DICT};
-      p--;
-      return {pdf_object::END, "unexpected '>'"};
+      if (peek() != '>')
+        return {pdf_object::END, "unexpected '>'"};
+      p++;
+      return {pdf_object::E_DICT};
     default:
       if (eat_newline(ch))
         return {pdf_object::NL};
@@ -257,100 +599,241 @@ struct pdf_lexer {
 };
 
 // FIXME lines /should not/ be longer than 255 characters, some wrapping is in order
-static std::string pdf_serialize(const pdf_object& o) {
+/// Append the decimal representation of `value', zero-padded to at least `width' digits (max. 20)
+static void pdf_append_decimal(std::string& out, unsigned long long value, size_t width = 0) {
+  char buf[20], *end = buf + sizeof buf, *p = end;
+  do *--p = '0' + value % 10; while (value /= 10);
+  while (size_t(end - p) < width)
+    *--p = '0';
+  out.append(p, end - p);
+}
+
+static void pdf_serialize_name(const std::string& name, std::string& out) {
+  static const char hex[] = "0123456789abcdef";
+  out += '/';
+  for (char c : name) {
+    if (c == '#' || strchr(pdf_lexer::delimiters, c) || strchr(pdf_lexer::whitespace, c)) {
+      out += '#';
+      out += hex[(unsigned char) c >> 4];
+      out += hex[c & 0xf];
+    } else {
+      out += c;
+    }
+  }
+}
+
+static void pdf_serialize(const pdf_object& o, std::string& out);
+
+static void pdf_serialize(const pdf_dict& dict, std::string& out) {
+  out += "<<";
+  for (const auto& i : dict) {
+    out += ' ';
+    pdf_serialize_name(i.first, out);
+    out += ' ';
+    pdf_serialize(i.second, out);
+  }
+  out += " >>";
+}
+
+/// Serialize an object by appending it to `out', avoiding any temporary strings
+static void pdf_serialize(const pdf_object& o, std::string& out) {
   switch (o.type) {
-  case pdf_object::NL:      return "\n";
-  case pdf_object::NIL:     return "null";
-  case pdf_object::BOOL:    return o.number ? "true" : "false";
+  case pdf_object::NL:      out += '\n';                    return;
+  case pdf_object::NIL:     out += "null";                  return;
+  case pdf_object::BOOL:    out += o.number ? "true" : "false"; return;
   case pdf_object::NUMERIC: {
-    if (o.is_integer()) return std::to_string((long long) o.number);
-    return std::to_string(o.number);
-  }
-  case pdf_object::KEYWORD: return o.string;
-  case pdf_object::NAME: {
-    std::string escaped = "/";
-    for (char c : o.string) {
-      if (c == '#' || strchr(pdf_lexer::delimiters, c) || strchr(pdf_lexer::whitespace, c))
-        escaped += ssprintf("#%02x", c);
-      else
-        escaped += c;
+    auto magnitude = std::fabs(o.number);
+    if (o.is_integer() && magnitude < 18446744073709551616.) {
+      if (o.number < 0)
+        out += '-';
+      pdf_append_decimal(out, (unsigned long long) magnitude);
+    } else {
+      // The largest doubles have 309 integer digits
+      char buf[512];
+      out.append(buf, std::snprintf(buf, sizeof buf, o.is_integer() ? "%.0f" : "%f", o.number));
     }
-    return escaped;
+    return;
   }
+  case pdf_object::KEYWORD: out += o.string; return;
+  case pdf_object::NAME:    pdf_serialize_name(o.string, out); return;
   case pdf_object::STRING: {
-    std::string escaped;
+    out += '(';
     for (char c : o.string) {
       if (c == '\\' || c == '(' || c == ')')
-        escaped += '\\';
-      escaped += c;
+        out += '\\';
+      out += c;
     }
-    return "(" + escaped + ")";
+    out += ')';
+    return;
   }
-  case pdf_object::B_ARRAY: return "[";
-  case pdf_object::E_ARRAY: return "]";
-  case pdf_object::B_DICT:  return "<<";
-  case pdf_object::E_DICT:  return ">>";
+  case pdf_object::B_ARRAY: out += '['; return;
+  case pdf_object::E_ARRAY: out += ']'; return;
+  case pdf_object::B_DICT:  out += "<<"; return;
+  case pdf_object::E_DICT:  out += ">>"; return;
   case pdf_object::ARRAY: {
-    std::vector<std::string> v;
-    for (const auto& i : o.array)
-      v.push_back(pdf_serialize(i));
-    return "[ " + concatenate(v, " ") + " ]";
-  }
-  case pdf_object::DICT: {
-    std::string s;
-    for (const auto i : o.dict)
-      // FIXME the key is also supposed to be escaped by pdf_serialize()
-      s += " /" + i.first + " " + pdf_serialize(i.second);
-    return "<<" + s + " >>";
+    out += "[ ";
+    for (const auto& i : o.array) {
+      if (&i != &o.array.front())
+        out += ' ';
+      pdf_serialize(i, out);
+    }
+    out += " ]";
+    return;
   }
+  case pdf_object::DICT:
+    pdf_serialize(o.dict, out);
+    return;
   case pdf_object::OBJECT:
-    return ssprintf("%u %u obj\n", o.n, o.generation) + pdf_serialize(o.array.at(0)) + "\nendobj";
+    pdf_append_decimal(out, o.n);
+    out += ' ';
+    pdf_append_decimal(out, o.generation);
+    out += " obj\n";
+    pdf_serialize(o.array.at(0), out);
+    out += "\nendobj";
+    return;
   case pdf_object::REFERENCE:
-    return ssprintf("%u %u R", o.n, o.generation);
+    pdf_append_decimal(out, o.n);
+    out += ' ';
+    pdf_append_decimal(out, o.generation);
+    out += " R";
+    return;
+  case pdf_object::STREAM: {
+    auto dict = o.dict;
+    dict["Length"] = {pdf_object::NUMERIC, double(o.string.length())};
+    pdf_serialize(dict, out);
+    out += "\nstream\n";
+    out += o.string;
+    out += "\nendstream";
+    return;
+  }
   default:
     assert(!"unsupported token for serialization");
   }
 }
 
+static std::string pdf_serialize(const pdf_object& o) {
+  std::string s;
+  pdf_serialize(o, s);
+  return s;
+}
+
 // -------------------------------------------------------------------------------------------------
 
 /// Utility class to help read and possibly incrementally update PDF files
 class pdf_updater {
   struct ref {
-    size_t offset = 0;     ///< File offset or N of the next free entry
+    size_t offset = 0;     ///< File offset, N of the next free entry, or index in an object stream
     uint generation = 0;   ///< Object generation
+    uint compressed = 0;   ///< PDF 1.5: N of the containing object stream, or zero
     bool free = true;      ///< Whether this N has been deleted
   };
 
+  /// Decoded stream data, in a least recently used list
+  struct decoded_stream {
+    std::string data;                               ///< Decoded stream contents
+    std::list<std::pair<uint, uint>>::iterator use; ///< Position in stream_use
+  };
+
   std::vector<ref> xref;   ///< Cross-reference table
   size_t xref_size = 0;    ///< Current cross-reference table size, correlated to xref.size()
   std::set<uint> updated;  ///< List of updated objects
 
-  pdf_object parse_obj(pdf_lexer& lex, std::vector<pdf_object>& stack) const;
-  pdf_object parse_R(std::vector<pdf_object>& stack) const;
-  pdf_object parse(pdf_lexer& lex, std::vector<pdf_object>& stack) const;
-  std::string load_xref(pdf_lexer& lex, std::set<uint>& loaded_entries);
+  /// A parsed object, along with its approximate size
+  struct cached_object {
+    pdf_object object;                              ///< The parsed object
+    size_t size;                                    ///< Its serialized size
+  };
+
+  /// Objects parsed so far
+  mutable std::map<std::pair<uint, uint>, cached_object, std::less<std::pair<uint, uint>>,
+    pdf_allocator<std::pair<const std::pair<uint, uint>, cached_object>>> cache;
+  mutable size_t cache_size = 0;                    ///< Total size of cached objects
+  mutable std::map<std::pair<uint, uint>, decoded_stream> streams;  ///< Decoded streams
+  mutable std::list<std::pair<uint, uint>> stream_use;  ///< Decoded streams, most recent first
+  mutable size_t streams_size = 0;                      ///< Total size of decoded streams
+
+  /// Object numbers and their offsets within decoded data of object streams parsed so far
+  mutable std::map<uint, std::vector<std::pair<uint, size_t>>> objstms;
+  mutable uint get_depth = 0;              ///< Recursion depth of get(), for loop protection
+
+  /// State as of the last call to save()
+  struct saved_state {
+    size_t updates_length = 0;             ///< Length of updates
+    size_t xref_size = 0;                  ///< Cross-reference table size
+    std::set<uint> updated;                ///< List of updated objects
+    pdf_dict trailer;                      ///< The new trailer dictionary
+    std::vector<std::pair<uint, ref>> refs;  ///< Original entries of changed objects
+  };
+  std::unique_ptr<saved_state> saved;      ///< Data for restore(), if any
+
+  void forget(uint n, uint generation);
+  void change(uint n);
+
+  pdf_object parse_obj(pdf_lexer& lex, pdf_array& stack) const;
+  pdf_object parse_R(pdf_array& stack) const;
+  pdf_object parse_stream(pdf_lexer& lex, pdf_array& stack) const;
+  pdf_object parse(pdf_lexer& lex, pdf_array& stack) const;
+  pdf_object parse_indirect(pdf_lexer& lex, uint n, uint generation) const;
+  pdf_object get_from_objstm(uint objstm_n, uint n, size_t index, size_t& size) const;
+  void load_xref_entry(size_t n, size_t offset, uint generation, bool free,
+                       std::vector<bool>& loaded_entries, uint compressed = 0);
+  size_t load_xref_rows(pdf_lexer& lex, size_t start, size_t count,
+                        std::vector<bool>& loaded_entries);
+  std::string load_xref_stream(pdf_lexer& lex, pdf_array& stack, std::vector<bool>& loaded_entries,
+                               pdf_object& trailer, const std::vector<bool>* table_entries);
+  std::string load_xref(pdf_lexer& lex, std::vector<bool>& loaded_entries, pdf_object& trailer);
+  pdf_lexer lexer_at(size_t offset) const;
+  void flush_xref_table(const std::map<uint, size_t>& groups);
+  void flush_xref_stream(const std::map<uint, size_t>& groups, uint n);
 
 public:
   /// The new trailer dictionary to be written, initialized with the old one
-  std::map<std::string, pdf_object> trailer;
+  pdf_dict trailer;
 
-  std::string& document;
-  pdf_updater(std::string& document) : document(document) {}
+  const char* document;    ///< The original document, which is never modified
+  size_t document_length;  ///< Length of the original document
+  std::string& updates;    ///< Incremental updates to be appended to the original document
+
+  pdf_updater(const char* document, size_t length, std::string& updates)
+    : document(document), document_length(length), updates(updates) {}
+
+  /// Return the total length of the document, including any updates made so far
+  size_t length() const { return document_length + updates.length(); }
 
   /// Build the cross-reference table and prepare a new trailer dictionary
   std::string initialize();
   /// Try to extract the claimed PDF version as a positive decimal number, e.g. 17 for PDF 1.7.
   /// Returns zero on failure.
   int version(const pdf_object& root) const;
-  /// Retrieve an object by its number and generation -- may return NIL or END with an error
-  pdf_object get(uint n, uint generation) const;
+  /// Limit on the total serialized size of cached objects, or zero for none.
+  /// Once exceeded, the whole cache is dropped.  Within a pdf_arena, dropped objects keep their
+  /// memory until the arena is destroyed, so there this only bounds how much the cache holds
+  /// at a time, not memory use.  pdf_sign() parses in an arena, and so leaves this unset.
+  size_t cache_limit = 0;
+
+  /// Retrieve an object by its number and generation -- may return NIL or END with an error.
+  /// The reference remains valid until the object is updated, or, with a cache_limit in place,
+  /// until the next call.
+  const pdf_object& get(uint n, uint generation) const;
+  /// Retrieve the data of a stream object, applying any filters
+  std::string get_stream_data(const pdf_object& stream, std::string& data) const;
+  /// Approximate limit on the memory used by decoded streams, or zero for none.
+  /// Once exceeded, the least recently used ones are dropped.
+  size_t stream_cache_limit = 64 << 20;
+  /// Retrieve the decoded data of a stream object by its number and generation, through a cache.
+  /// The pointer remains valid until the object is updated, or the next call.
+  std::string get_stream(uint n, uint generation, const std::string*& data) const;
   /// Allocate a new object number
   uint allocate();
   /// Append an updated object to the end of the document
   void update(uint n, std::function<void()> fill);
-  /// Write an updated cross-reference table and trailer
-  void flush_updates();
+  /// Write an updated cross-reference table and trailer, or stream, returning an error message
+  /// on failure.  Any further updates will form another incremental update on top of this one.
+  std::string flush_updates();
+  /// Remember the current state, so that any changes made after this point can be undone
+  void save();
+  /// Undo all changes made since the last call to save(), which remains in effect
+  void restore();
 };
 
 // -------------------------------------------------------------------------------------------------
@@ -361,7 +844,7 @@ static std::string pdf_error(const pdf_object& o, const char* err) {
   return o.string;
 }
 
-pdf_object pdf_updater::parse_obj(pdf_lexer& lex, std::vector<pdf_object>& stack) const {
+pdf_object pdf_updater::parse_obj(pdf_lexer& lex, pdf_array& stack) const {
   if (stack.size() < 2)
     return {pdf_object::END, "missing object ID pair"};
 
@@ -386,7 +869,7 @@ pdf_object pdf_updater::parse_obj(pdf_lexer& lex, std::vector<pdf_object>& stack
   return obj;
 }
 
-pdf_object pdf_updater::parse_R(std::vector<pdf_object>& stack) const {
+pdf_object pdf_updater::parse_R(pdf_array& stack) const {
   if (stack.size() < 2)
     return {pdf_object::END, "missing reference ID pair"};
 
@@ -402,8 +885,44 @@ pdf_object pdf_updater::parse_R(std::vector<pdf_object>& stack) const {
   return ref;
 }
 
+pdf_object pdf_updater::parse_stream(pdf_lexer& lex, pdf_array& stack) const {
+  if (stack.empty())
+    return {pdf_object::END, "missing stream dictionary"};
+  if (stack.back().type != pdf_object::DICT)
+    return {pdf_object::END, "stream not preceded by a dictionary"};
+
+  pdf_object stream{std::move(stack.back())};
+  stack.pop_back();
+  stream.type = pdf_object::STREAM;
+
+  auto length = stream.dict.find("Length");
+  if (length == stream.dict.end())
+    return {pdf_object::END, "missing stream Length"};
+  auto size = length->second.type == pdf_object::REFERENCE
+    ? &get(length->second.n, length->second.generation) : &length->second;
+  uint64_t stream_length = 0;
+  if (!size->get_unsigned(stream_length))
+    return {pdf_object::END, "stream Length not an unsigned integer"};
+
+  // Expect exactly one newline
+  auto nl = lex.next();
+  if (nl.type != pdf_object::NL)
+    return {pdf_object::END, pdf_error(nl, "stream does not start with a newline")};
+  if (stream_length > uint64_t(lex.end - lex.p))
+    return {pdf_object::END, "stream is longer than the document"};
+
+  stream.string.assign(reinterpret_cast<const char*>(lex.p), stream_length);
+  lex.p += stream_length;
+
+  // Skip any number of trailing newlines or comments
+  auto end = parse(lex, stack);
+  if (end.type != pdf_object::KEYWORD || end.string != "endstream")
+    return {pdf_object::END, pdf_error(end, "improperly terminated stream")};
+  return stream;
+}
+
 /// Read an object at the lexer's position.  Not a strict parser.
-pdf_object pdf_updater::parse(pdf_lexer& lex, std::vector<pdf_object>& stack) const {
+pdf_object pdf_updater::parse(pdf_lexer& lex, pdf_array& stack) const {
   auto token = lex.next();
   switch (token.type) {
   case pdf_object::NL:
@@ -411,7 +930,7 @@ pdf_object pdf_updater::parse(pdf_lexer& lex, std::vector<pdf_object>& stack) co
     // These are not important to parsing, not even for this procedure's needs
     return parse(lex, stack);
   case pdf_object::B_ARRAY: {
-    std::vector<pdf_object> array;
+    pdf_array array;
     while (1) {
       auto object = parse(lex, array);
       if (object.type == pdf_object::END)
@@ -423,7 +942,7 @@ pdf_object pdf_updater::parse(pdf_lexer& lex, std::vector<pdf_object>& stack) co
     return array;
   }
   case pdf_object::B_DICT: {
-    std::vector<pdf_object> array;
+    pdf_array array;
     while (1) {
       auto object = parse(lex, array);
       if (object.type == pdf_object::END)
@@ -434,19 +953,18 @@ pdf_object pdf_updater::parse(pdf_lexer& lex, std::vector<pdf_object>& stack) co
     }
     if (array.size() % 2)
       return {pdf_object::END, "unbalanced dictionary"};
-    std::map<std::string, pdf_object> dict;
+    pdf_dict::storage pairs;
+    pairs.reserve(array.size() / 2);
     for (size_t i = 0; i < array.size(); i += 2) {
       if (array[i].type != pdf_object::NAME)
         return {pdf_object::END, "invalid dictionary key type"};
-      dict.insert({array[i].string, std::move(array[i + 1])});
+      pairs.emplace_back(std::move(array[i].string), std::move(array[i + 1]));
     }
-    return dict;
+    return pdf_dict(std::move(pairs));
   }
   case pdf_object::KEYWORD:
     // Appears in the document body, typically needs to access the cross-reference table
-    // TODO use the xref to read /Length etc. once we actually need to read such objects;
-    //   presumably streams can use the pdf_object::string member
-    if (token.string == "stream") return {pdf_object::END, "streams are not supported yet"};
+    if (token.string == "stream") return parse_stream(lex, stack);
     if (token.string == "obj")    return parse_obj(lex, stack);
     if (token.string == "R")      return parse_R(stack);
     return token;
@@ -455,12 +973,196 @@ pdf_object pdf_updater::parse(pdf_lexer& lex, std::vector<pdf_object>& stack) co
   }
 }
 
-std::string pdf_updater::load_xref(pdf_lexer& lex, std::set<uint>& loaded_entries) {
-  std::vector<pdf_object> throwaway_stack;
+/// Check that `p' starts with ten decimal digits, a space, and five more decimal digits
+static bool xref_row_digits(const char* p) {
+#ifdef __SSE2__
+  auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+  auto d = _mm_sub_epi8(v, _mm_set1_epi8('0'));
+  int digits = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(9)), d));
+  int spaces = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+  return (digits | 1 << 10) == 0xFFFF && (spaces & 1 << 10);
+#else
+  for (int i = 0; i < 16; i++)
+    if (i == 10 ? p[i] != ' ' : (p[i] < '0' || p[i] > '9'))
+      return false;
+  return true;
+#endif
+}
+
+void pdf_updater::load_xref_entry(size_t n, size_t offset, uint generation, bool free,
+    std::vector<bool>& loaded_entries, uint compressed) {
+  // Entries from more recent sections take precedence
+  if (n < loaded_entries.size() && loaded_entries[n])
+    return;
+  if (n >= loaded_entries.size())
+    loaded_entries.resize(n + 1);
+  if (n >= xref.size())
+    xref.resize(n + 1);
+  loaded_entries[n] = true;
+
+  auto& ref = xref[n];
+  ref.generation = generation;
+  ref.offset = offset;
+  ref.compressed = compressed;
+  ref.free = free;
+}
+
+/// Decode as many rows in the canonical 20-byte format as possible, returning their count.
+/// The rest of the subsection is left for the tolerant parser, and will be reported by it.
+size_t pdf_updater::load_xref_rows(pdf_lexer& lex, size_t start, size_t count,
+    std::vector<bool>& loaded_entries) {
+  while (lex.peek() && strchr(pdf_lexer::whitespace, lex.peek()))
+    lex.p++;
+
+  size_t i = 0;
+  for (auto p = reinterpret_cast<const char*>(lex.p); i < count; i++, p += 20) {
+    if (reinterpret_cast<const char*>(lex.end) - p < 20 || !xref_row_digits(p) ||
+        p[16] != ' ' || (p[17] != 'n' && p[17] != 'f') ||
+        !((p[18] == ' ' && (p[19] == '\r' || p[19] == '\n')) || (p[18] == '\r' && p[19] == '\n')))
+      break;
+
+    size_t offset = 0;
+    uint generation = 0;
+    for (int k = 0; k < 10; k++)
+      offset = offset * 10 + (p[k] - '0');
+    for (int k = 11; k < 16; k++)
+      generation = generation * 10 + (p[k] - '0');
+    if (offset > document_length || generation > 65535)
+      break;
+
+    load_xref_entry(start + i, offset, generation, p[17] == 'f', loaded_entries);
+  }
+  lex.p += 20 * i;
+  return i;
+}
+
+/// Load a cross-reference stream, following any objects already on the stack.  With table_entries,
+/// it supplements the table of a hybrid-reference section, which takes precedence wherever it lists
+/// an object as being in use.
+std::string pdf_updater::load_xref_stream(pdf_lexer& lex, pdf_array& stack,
+    std::vector<bool>& loaded_entries, pdf_object& trailer, const std::vector<bool>* table_entries) {
+  pdf_object object;
+  while (1) {
+    object = parse(lex, stack);
+    if (object.type == pdf_object::END)
+      return "invalid xref table: " + pdf_error(object, "unexpected end of input");
+
+    // For the sake of simplicity, keep stacking until we find an object
+    if (object.type == pdf_object::OBJECT)
+      break;
+    stack.push_back(std::move(object));
+  }
+
+  // ISO 32000-2:2020 7.5.8.2 Cross-reference stream dictionary
+  auto& stream = object.array.at(0);
+  if (stream.type != pdf_object::STREAM)
+    return "invalid xref table";
+  auto type = stream.dict.find("Type");
+  if (type == stream.dict.end() || type->second.type != pdf_object::NAME ||
+      type->second.string != "XRef")
+    return "invalid xref stream";
+
+  std::string data;
+  auto err = get_stream_data(stream, data);
+  if (!err.empty())
+    return "invalid xref stream: " + err;
+
+  auto size = stream.dict.find("Size");
+  if (size == stream.dict.end() || !size->second.is_integer() || size->second.number <= 0 ||
+      size->second.number > UINT_MAX)
+    return "invalid or missing cross-reference stream Size";
+
+  std::vector<std::pair<size_t, size_t>> subsections;
+  auto index = stream.dict.find("Index");
+  if (index == stream.dict.end()) {
+    subsections.emplace_back(0, size->second.number);
+  } else {
+    const auto& a = index->second.array;
+    if (index->second.type != pdf_object::ARRAY || a.size() % 2)
+      return "invalid cross-reference stream Index";
+    for (size_t i = 0; i < a.size(); i += 2) {
+      if (!a[i].is_integer() || a[i].number < 0 || a[i].number > UINT_MAX ||
+          !a[i + 1].is_integer() || a[i + 1].number < 0 || a[i + 1].number > UINT_MAX)
+        return "invalid cross-reference stream Index";
+      subsections.emplace_back(a[i].number, a[i + 1].number);
+    }
+  }
+
+  auto w = stream.dict.find("W");
+  if (w == stream.dict.end() || w->second.type != pdf_object::ARRAY || w->second.array.size() != 3)
+    return "invalid or missing cross-reference stream W";
+  size_t widths[3], unit = 0;
+  for (int i = 0; i < 3; i++) {
+    const auto& width = w->second.array[i];
+    if (!width.is_integer() || width.number < 0 || width.number > 8)
+      return "invalid cross-reference stream W";
+    unit += (widths[i] = width.number);
+  }
+  if (!widths[1] || data.length() % unit)
+    return "invalid cross-reference stream length";
+
+  // ISO 32000-2:2020 7.5.8.3 Cross-reference stream data
+  auto p = reinterpret_cast<const unsigned char*>(data.data());
+  auto read_field = [&](size_t width, uint64_t value) {
+    if (width)
+      value = 0;
+    while (width--)
+      value = value << 8 | *p++;
+    return value;
+  };
+  size_t remaining = data.length() / unit;
+  for (const auto& subsection : subsections) {
+    if (subsection.second > remaining)
+      return "premature cross-reference stream EOF";
+    remaining -= subsection.second;
+
+    for (size_t i = 0; i < subsection.second; i++) {
+      auto f1 = read_field(widths[0], 1);
+      auto f2 = read_field(widths[1], 0);
+      auto f3 = read_field(widths[2], 0);
+      if ((f1 == 2 ? f2 : f3) > UINT_MAX)
+        return "invalid cross-reference stream contents";
+
+      auto n = subsection.first + i;
+      if (table_entries && (f1 == 0 ||
+          (n < table_entries->size() && (*table_entries)[n] && !xref[n].free)))
+        continue;
+
+      switch (f1) {
+      case 0:
+        load_xref_entry(n, f2, f3, true, loaded_entries);
+        break;
+      case 1:
+        load_xref_entry(n, f2, f3, false, loaded_entries);
+        break;
+      case 2:
+        if (!f2 || f2 == n)
+          return "invalid cross-reference stream contents";
+        load_xref_entry(n, f3, 0, false, loaded_entries, f2);
+        break;
+      default:
+        // TODO it should be treated as a reference to the null object,
+        //   which we can't currently represent
+        return "unsupported cross-reference stream contents";
+      }
+    }
+  }
+
+  trailer = {std::move(stream.dict)};
+  return "";
+}
+
+/// Load a cross-reference section, either a table or a stream.  Returns the trailer dictionary.
+std::string pdf_updater::load_xref(pdf_lexer& lex, std::vector<bool>& loaded_entries,
+    pdf_object& trailer) {
+  pdf_array throwaway_stack;
   {
     auto keyword = parse(lex, throwaway_stack);
-    if (keyword.type != pdf_object::KEYWORD || keyword.string != "xref")
-      return "invalid xref table";
+    if (keyword.type != pdf_object::KEYWORD || keyword.string != "xref") {
+      pdf_array stack;
+      stack.push_back(std::move(keyword));
+      return load_xref_stream(lex, stack, loaded_entries, trailer, nullptr);
+    }
   }
   while (1) {
     auto object = parse(lex, throwaway_stack);
@@ -476,12 +1178,12 @@ std::string pdf_updater::load_xref(pdf_lexer& lex, std::set<uint>& loaded_entrie
 
     const size_t start = object.number;
     const size_t count = second.number;
-    for (size_t i = 0; i < count; i++) {
+    for (size_t i = load_xref_rows(lex, start, count, loaded_entries); i < count; i++) {
       auto off = parse(lex, throwaway_stack);
       auto gen = parse(lex, throwaway_stack);
       auto key = parse(lex, throwaway_stack);
-      if (!off.is_integer() || off.number < 0 || off.number > document.length() ||
-          !gen.is_integer() || gen.number < 0 || gen.number > 65535 ||
+      uint64_t offset = 0, generation = 0;
+      if (!off.get_unsigned(offset, document_length) || !gen.get_unsigned(generation, 65535) ||
           key.type != pdf_object::KEYWORD)
         return "invalid xref entry";
 
@@ -491,71 +1193,151 @@ std::string pdf_updater::load_xref(pdf_lexer& lex, std::set<uint>& loaded_entrie
       else if (key.string != "f")
         return "invalid xref entry";
 
-      auto n = start + i;
-      if (loaded_entries.count(n))
-        continue;
-      if (n >= xref.size())
-        xref.resize(n + 1);
-      loaded_entries.insert(n);
-
-      auto& ref = xref[n];
-      ref.generation = gen.number;
-      ref.offset = off.number;
-      ref.free = free;
+      load_xref_entry(start + i, offset, generation, free, loaded_entries);
     }
   }
+
+  trailer = parse(lex, throwaway_stack);
+  if (trailer.type != pdf_object::DICT)
+    return pdf_error(trailer, "invalid trailer dictionary");
   return "";
 }
 
+pdf_lexer pdf_updater::lexer_at(size_t offset) const {
+  if (offset < document_length)
+    return pdf_lexer(document + offset, document + document_length);
+  return pdf_lexer(updates.data() + (offset - document_length), updates.data() + updates.length());
+}
+
 // -------------------------------------------------------------------------------------------------
 
+static bool is_space(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+}
+
+static bool is_digit(char c) {
+  return c >= '0' && c <= '9';
+}
+
+/// Find the last "startxref" within [begin, end) that is preceded by whitespace and followed
+/// by an offset and the end-of-file comment.  Returns the offset on success.
+static bool find_startxref(const char* begin, const char* end, size_t& offset) {
+  static const char keyword[] = "startxref";
+  const size_t keyword_len = sizeof keyword - 1;
+  for (auto p = end; p - begin > ptrdiff_t(keyword_len); ) {
+    if (memcmp(--p - keyword_len + 1, keyword, keyword_len))
+      continue;
+
+    auto q = p + 1, keyword_start = q - keyword_len;
+    if (!is_space(keyword_start[-1]) || q == end || !is_space(*q))
+      continue;
+    while (q != end && is_space(*q))
+      q++;
+
+    size_t value = 0;
+    auto digits = q;
+    while (q != end && is_digit(*q) && value <= (SIZE_MAX - 9) / 10)
+      value = value * 10 + (*q++ - '0');
+    if (q == digits || q == end || !is_space(*q))
+      continue;
+    while (q != end && is_space(*q))
+      q++;
+    if (end - q >= 5 && !memcmp(q, "%%EOF", 5)) {
+      offset = value;
+      return true;
+    }
+  }
+  return false;
+}
+
+/// Find the first "%PDF-x.y" header within [begin, end) that starts a line, also accepting
+/// a PostScript prefix.  Returns the version as a decimal number, or zero on failure.
+static int find_header_version(const char* begin, const char* end) {
+  for (auto p = begin; p != end; p++) {
+    if (*p != '%' || (p != begin && p[-1] != '\r' && p[-1] != '\n'))
+      continue;
+
+    auto q = p + 1;
+    if (end - q >= 16 && !memcmp(q, "!PS-Adobe-", 10) &&
+        is_digit(q[10]) && q[11] == '.' && is_digit(q[12]) && q[13] == ' ')
+      q += 14;
+    if (end - q >= 8 && !memcmp(q, "PDF-", 4) &&
+        is_digit(q[4]) && q[5] == '.' && is_digit(q[6]) && (q[7] == '\r' || q[7] == '\n'))
+      return (q[4] - '0') * 10 + (q[6] - '0');
+  }
+  return 0;
+}
+
 std::string pdf_updater::initialize() {
-  // We only need to look for startxref roughly within the last kibibyte of the document
-  static std::regex haystack_re(R"([\s\S]*\sstartxref\s+(\d+)\s+%%EOF)");
-  std::string haystack = document.substr(document.length() < 1024 ? 0 : document.length() - 1024);
+  pdf_stats::timer timer(pdf_stats::XREF);
 
-  std::smatch m;
-  if (!std::regex_search(haystack, m, haystack_re, std::regex_constants::match_continuous))
+  // We only need to look for startxref roughly within the last kibibyte of the document
+  size_t xref_offset = 0;
+  if (!find_startxref(document_length < 1024 ? document : document + document_length - 1024,
+                      document + document_length, xref_offset))
     return "cannot find startxref";
 
-  size_t xref_offset = std::stoul(m.str(1)), last_xref_offset = xref_offset;
+  size_t last_xref_offset = xref_offset;
   std::set<size_t> loaded_xrefs;
-  std::set<uint> loaded_entries;
+  std::vector<bool> loaded_entries;
 
-  std::vector<pdf_object> throwaway_stack;
   while (1) {
     if (loaded_xrefs.count(xref_offset))
       return "circular xref offsets";
-    if (xref_offset >= document.length())
+    if (xref_offset >= document_length)
       return "invalid xref offset";
 
-    pdf_lexer lex(document.c_str() + xref_offset);
-    auto err = load_xref(lex, loaded_entries);
+    // Entries from more recent sections, in case this one turns out to be hybrid-reference
+    auto newer_entries = loaded_entries;
+
+    pdf_object trailer;
+    pdf_lexer lex(document + xref_offset, document + document_length);
+    auto err = load_xref(lex, loaded_entries, trailer);
     if (!err.empty()) return err;
+    pdf_stats::count(pdf_stats::XREF_SECTIONS);
 
-    auto trailer = parse(lex, throwaway_stack);
-    if (trailer.type != pdf_object::DICT)
-      return pdf_error(trailer, "invalid trailer dictionary");
     if (loaded_xrefs.empty())
       this->trailer = trailer.dict;
     loaded_xrefs.insert(xref_offset);
 
+    // ISO 32000-2:2020 7.5.8.4 Compatibility with applications that do not support compressed
+    // reference streams: objects stored in object streams are only listed in XRefStm
+    const auto xref_stm = trailer.dict.find("XRefStm");
+    if (xref_stm != trailer.dict.end()) {
+      uint64_t stm_offset = 0;
+      if (!xref_stm->second.get_unsigned(stm_offset) || stm_offset >= document_length)
+        return "invalid XRefStm offset";
+
+      pdf_array stack;
+      pdf_object stm_trailer;
+      pdf_lexer stm_lex(document + stm_offset, document + document_length);
+      err = load_xref_stream(stm_lex, stack, newer_entries, stm_trailer, &loaded_entries);
+      if (!err.empty()) return err;
+      pdf_stats::count(pdf_stats::XREF_SECTIONS);
+      for (size_t i = 0; i < newer_entries.size(); i++)
+        if (newer_entries[i]) {
+          if (i >= loaded_entries.size())
+            loaded_entries.resize(i + 1);
+          loaded_entries[i] = true;
+        }
+    }
+
     const auto prev_offset = trailer.dict.find("Prev");
     if (prev_offset == trailer.dict.end())
       break;
-    // FIXME do not read offsets and sizes as floating point numbers
-    if (!prev_offset->second.is_integer() || prev_offset->second.number < 0)
+    uint64_t offset = 0;
+    if (!prev_offset->second.get_unsigned(offset, document_length))
       return "invalid Prev offset";
-    xref_offset = prev_offset->second.number;
+    xref_offset = offset;
   }
 
   trailer["Prev"] = {pdf_object::NUMERIC, double(last_xref_offset)};
   const auto last_size = trailer.find("Size");
-  if (last_size == trailer.end() || !last_size->second.is_integer() ||
-      last_size->second.number <= 0)
+  uint64_t size = 0;
+  if (last_size == trailer.end() || !last_size->second.get_unsigned(size, UINT_MAX) || !size)
     return "invalid or missing cross-reference table Size";
 
-  xref_size = last_size->second.number;
+  xref_size = size;
   return "";
 }
 
@@ -568,26 +1350,11 @@ int pdf_updater::version(const pdf_object& root) const {
   }
 
   // We only need to look for the comment roughly within the first kibibyte of the document
-  static std::regex version_re(R"((?:^|[\r\n])%(?:!PS-Adobe-\d\.\d )?PDF-(\d)\.(\d)[\r\n])");
-  std::string haystack = document.substr(0, 1024);
-
-  std::smatch m;
-  if (std::regex_search(haystack, m, version_re, std::regex_constants::match_default))
-    return std::stoul(m.str(1)) * 10 + std::stoul(m.str(2));
-
-  return 0;
+  return find_header_version(document, document + std::min(document_length, size_t(1024)));
 }
 
-pdf_object pdf_updater::get(uint n, uint generation) const {
-  if (n >= xref_size)
-    return {pdf_object::NIL};
-
-  const auto& ref = xref[n];
-  if (ref.free || ref.generation != generation || ref.offset >= document.length())
-    return {pdf_object::NIL};
-
-  pdf_lexer lex(document.c_str() + ref.offset);
-  std::vector<pdf_object> stack;
+pdf_object pdf_updater::parse_indirect(pdf_lexer& lex, uint n, uint generation) const {
+  pdf_array stack;
   while (1) {
     auto object = parse(lex, stack);
     if (object.type == pdf_object::END)
@@ -601,234 +1368,2519 @@ pdf_object pdf_updater::get(uint n, uint generation) const {
   }
 }
 
-uint pdf_updater::allocate() {
-  assert(xref_size < UINT_MAX);
+pdf_object pdf_updater::get_from_objstm(uint objstm_n, uint n, size_t index, size_t& size) const {
+  const std::string* data = nullptr;
+  auto cached = objstms.find(objstm_n);
+  if (cached == objstms.end()) {
+    const auto& stream = get(objstm_n, 0);
+    if (stream.type != pdf_object::STREAM)
+      return {pdf_object::END, pdf_error(stream, "invalid ObjStm")};
+    auto type = stream.dict.find("Type");
+    if (type == stream.dict.end() || type->second.type != pdf_object::NAME ||
+        type->second.string != "ObjStm")
+      return {pdf_object::END, "invalid ObjStm"};
 
-  auto n = xref_size++;
-  if (xref.size() < xref_size)
-    xref.resize(xref_size);
+    // NOTE this means descending into that stream if n is not found here,
+    //   it is meant to be an object reference
+    auto extends = stream.dict.find("Extends");
+    if (extends != stream.dict.end() && extends->second.type != pdf_object::NIL)
+      return {pdf_object::END, "ObjStm extensions are unsupported"};
 
-  // We don't make sure it gets a subsection in the update yet because we
-  // make no attempts at fixing the linked list of free items either
-  return n;
-}
+    auto entry_n = stream.dict.find("N");
+    uint64_t count = 0, first = 0;
+    if (entry_n == stream.dict.end() || !entry_n->second.get_unsigned(count) || !count)
+      return {pdf_object::END, "invalid ObjStm N"};
+    auto entry_first = stream.dict.find("First");
+    if (entry_first == stream.dict.end() || !entry_first->second.get_unsigned(first) || !first)
+      return {pdf_object::END, "invalid ObjStm First"};
 
-void pdf_updater::update(uint n, std::function<void()> fill) {
-  auto& ref = xref.at(n);
-  ref.offset = document.length() + 1;
-  ref.free = false;
-  updated.insert(n);
+    auto err = get_stream(objstm_n, 0, data);
+    if (!err.empty())
+      return {pdf_object::END, "invalid ObjStm: " + err};
+    if (first > data->length())
+      return {pdf_object::END, "invalid ObjStm First"};
 
-  document += ssprintf("\n%u %u obj\n", n, ref.generation);
-  // Separately so that the callback can use document.length() to get the current offset
-  fill();
-  document += "\nendobj";
-}
+    std::vector<std::pair<uint, size_t>> objects;
+    pdf_array throwaway_stack;
+    pdf_lexer lex(data->data(), data->data() + first);
+    for (size_t i = 0; i < count; i++) {
+      auto object_n = parse(lex, throwaway_stack);
+      auto object_offset = parse(lex, throwaway_stack);
+      uint64_t number = 0, offset = 0;
+      if (!object_n.get_unsigned(number, UINT_MAX) ||
+          !object_offset.get_unsigned(offset, data->length() - first) ||
+          (i && objects.back().second >= first + offset))
+        return {pdf_object::END, "invalid ObjStm pairs"};
+      objects.emplace_back(number, first + offset);
+    }
+    cached = objstms.emplace(objstm_n, std::move(objects)).first;
+  }
 
-void pdf_updater::flush_updates() {
-  std::map<uint, size_t> groups;
-  for (auto i = updated.cbegin(); i != updated.cend(); ) {
-    size_t start = *i, count = 1;
-    while (++i != updated.cend() && *i == start + count)
-      count++;
-    groups[start] = count;
+  // The index from the cross-reference stream should be right, but don't rely on it
+  const auto& objects = cached->second;
+  if (index >= objects.size() || objects[index].first != n) {
+    for (index = 0; index < objects.size(); index++)
+      if (objects[index].first == n)
+        break;
+    if (index == objects.size())
+      return {pdf_object::END, "object not found in ObjStm"};
   }
 
-  // Taking literally "Each cross-reference section begins with a line containing the keyword xref.
-  // Following this line are one or more cross-reference subsections." from 3.4.3 in PDF Reference
-  if (groups.empty())
-    groups[0] = 0;
+  if (!data) {
+    auto err = get_stream(objstm_n, 0, data);
+    if (!err.empty())
+      return {pdf_object::END, "invalid ObjStm: " + err};
+  }
+  auto end = index + 1 < objects.size() ? objects[index + 1].second : data->length();
+  if (end > data->length())
+    return {pdf_object::END, "invalid ObjStm pairs"};
+  size = end - objects[index].second;
 
-  auto startxref = document.length() + 1;
-  document += "\nxref\n";
-  for (const auto& g : groups) {
-    document += ssprintf("%u %zu\n", g.first, g.second);
-    for (size_t i = 0; i < g.second; i++) {
+  pdf_array stack;
+  pdf_lexer lex(data->data() + objects[index].second, data->data() + end);
+  while (1) {
+    auto object = parse(lex, stack);
+    if (object.type == pdf_object::END && !object.string.empty())
+      return object;
+    if (object.type == pdf_object::END)
+      break;
+    stack.push_back(std::move(object));
+  }
+  if (stack.empty())
+    return {pdf_object::END, "empty ObjStm object"};
+  return std::move(stack.front());
+}
+
+const pdf_object& pdf_updater::get(uint n, uint generation) const {
+  static const pdf_object nil{pdf_object::NIL};
+  static const pdf_object too_deep{pdf_object::END, "too deeply nested object references"};
+  if (n >= xref_size)
+    return nil;
+
+  const auto& ref = xref[n];
+  if (ref.free || ref.generation != generation || (!ref.compressed && ref.offset >= length()))
+    return nil;
+
+  auto key = std::make_pair(n, generation);
+  auto cached = cache.find(key);
+  if (cached != cache.end()) {
+    pdf_stats::count(pdf_stats::OBJECT_CACHE_HITS);
+    return cached->second.object;
+  }
+
+  // Stream lengths and object streams may be referenced indirectly, possibly in a loop
+  if (get_depth >= 16)
+    return too_deep;
+
+  size_t size = 0;
+  pdf_object result;
+  get_depth++;
+  if (ref.compressed) {
+    result = get_from_objstm(ref.compressed, n, ref.offset, size);
+  } else {
+    auto lex = lexer_at(ref.offset);
+    auto start = lex.p;
+    result = parse_indirect(lex, n, generation);
+    size = lex.p - start;
+  }
+  get_depth--;
+  pdf_stats::count(pdf_stats::OBJECTS_PARSED);
+
+  if (cache_limit && cache_size + size > cache_limit) {
+    cache.clear();
+    cache_size = 0;
+  }
+  cache_size += size;
+  return cache.emplace(key, cached_object{std::move(result), size}).first->second.object;
+}
+
+/// Limit on decompressed stream data, which is far beyond what cross-reference and object streams
+/// need, but stops small streams from decompressing into all available memory
+static constexpr size_t pdf_inflate_limit = 256 << 20;
+
+/// Decompress zlib data, returns an error message on failure, including exceeding the limit.
+/// The expected size of the output may be given as a hint, or zero to have it guessed.
+static std::string pdf_inflate(const std::string& in, std::string& out, size_t size_hint) {
+  out.resize(std::min(size_hint ? size_hint : std::max(in.length() * 4, size_t(4096)),
+                      pdf_inflate_limit));
+#ifdef HAVE_LIBDEFLATE
+  static thread_local std::unique_ptr<libdeflate_decompressor, void (*)(libdeflate_decompressor*)>
+    decompressor(libdeflate_alloc_decompressor(), libdeflate_free_decompressor);
+  if (!decompressor)
+    return "libdeflate initialization failed";
+
+  // libdeflate only decompresses into a fixed buffer, so retry with larger ones as necessary
+  while (1) {
+    size_t actual = 0;
+    auto result = libdeflate_zlib_decompress(decompressor.get(),
+      in.data(), in.length(), &out[0], out.length(), &actual);
+    if (result == LIBDEFLATE_SUCCESS) {
+      out.resize(actual);
+      return "";
+    }
+    if (result != LIBDEFLATE_INSUFFICIENT_SPACE)
+      return "invalid Flate data";
+    if (out.length() >= pdf_inflate_limit)
+      return "decompressed stream data are too large";
+    out.resize(std::min(out.length() * 2, pdf_inflate_limit));
+  }
+#else
+  z_stream z = {};
+  if (inflateInit(&z) != Z_OK)
+    return "zlib initialization failed";
+
+  z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
+  z.avail_in = in.length();
+
+  int status = Z_OK;
+  while (status == Z_OK || (status == Z_BUF_ERROR && !z.avail_out)) {
+    if (z.total_out == out.length() && out.length() >= pdf_inflate_limit) {
+      inflateEnd(&z);
+      return "decompressed stream data are too large";
+    }
+    if (z.total_out == out.length())
+      out.resize(std::min(out.length() * 2, pdf_inflate_limit));
+    z.next_out = reinterpret_cast<Bytef*>(&out[z.total_out]);
+    z.avail_out = out.length() - z.total_out;
+    status = inflate(&z, Z_NO_FLUSH);
+  }
+  out.resize(z.total_out);
+  inflateEnd(&z);
+  if (status != Z_STREAM_END)
+    return z.msg ? z.msg : "truncated Flate data";
+  return "";
+#endif
+}
+
+/// Undo PNG predictors as found in DecodeParms, most commonly used by cross-reference streams
+static std::string pdf_unpredict(const pdf_object& parms, std::string& data) {
+  auto param = [&](const char* key, double fallback) {
+    auto i = parms.dict.find(key);
+    return (i == parms.dict.end() || !i->second.is_integer()) ? fallback : i->second.number;
+  };
+  if (parms.type != pdf_object::DICT)
+    return "invalid DecodeParms";
+
+  auto predictor = param("Predictor", 1);
+  if (predictor == 1)
+    return "";
+  if (predictor < 10 || predictor > 15)
+    return "unsupported predictor";
+
+  auto colors = param("Colors", 1), bpc = param("BitsPerComponent", 8), columns = param("Columns", 1);
+  if (colors < 1 || colors > 32 || (bpc != 1 && bpc != 2 && bpc != 4 && bpc != 8 && bpc != 16) ||
+      columns < 1 || columns > 1 << 24)
+    return "invalid predictor parameters";
+
+  // ISO 32000-2:2020 7.4.4.4 LZW and Flate predictor functions, also see RFC 2083
+  const size_t bpp = std::max(1., colors * bpc / 8), row = (size_t(colors * bpc * columns) + 7) / 8;
+  if (data.length() % (row + 1))
+    return "invalid predicted data length";
+
+  std::string result;
+  result.reserve(data.length() / (row + 1) * row);
+  auto in = reinterpret_cast<const unsigned char*>(data.data());
+  for (size_t y = 0; y < data.length() / (row + 1); y++, in += row + 1) {
+    auto type = in[0];
+    auto prior = y ? reinterpret_cast<const unsigned char*>(&result[result.length() - row]) : nullptr;
+    for (size_t x = 0; x < row; x++) {
+      int a = x >= bpp ? (unsigned char) result[result.length() - bpp] : 0;
+      int b = prior ? prior[x] : 0;
+      int c = prior && x >= bpp ? prior[x - bpp] : 0;
+      int value = in[1 + x];
+      switch (type) {
+      case 0: break;
+      case 1: value += a; break;
+      case 2: value += b; break;
+      case 3: value += (a + b) / 2; break;
+      case 4: {
+        int pa = std::abs(b - c), pb = std::abs(a - c), pc = std::abs(a + b - 2 * c);
+        value += (pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c);
+        break;
+      }
+      default:
+        return "invalid PNG predictor type";
+      }
+      result += char(value);
+    }
+  }
+  data = std::move(result);
+  return "";
+}
+
+std::string pdf_updater::get_stream_data(const pdf_object& stream, std::string& data) const {
+  auto f = stream.dict.find("F");
+  if (f != stream.dict.end() && f->second.type != pdf_object::NIL)
+    return "stream data in other files are unsupported";
+
+  // Support just enough to decode common cross-reference and object streams
+  auto filter = stream.dict.find("Filter");
+  if (filter == stream.dict.end() || filter->second.type == pdf_object::NIL) {
+    data = stream.string;
+    return "";
+  }
+
+  const pdf_object* name = &filter->second;
+  if (name->type == pdf_object::ARRAY && name->array.size() == 1)
+    name = &name->array[0];
+  if (name->type != pdf_object::NAME || name->string != "FlateDecode")
+    return "unsupported stream Filter";
+
+  // DL is only advisory, but it will usually save us from having to reallocate
+  auto dl = stream.dict.find("DL");
+  size_t size_hint = 0;
+  if (dl != stream.dict.end() && dl->second.is_integer() && dl->second.number > 0 &&
+      dl->second.number <= pdf_inflate_limit)
+    size_hint = dl->second.number;
+
+  auto err = pdf_inflate(stream.string, data, size_hint);
+  if (!err.empty())
+    return err;
+
+  auto parms = stream.dict.find("DecodeParms");
+  if (parms == stream.dict.end() || parms->second.type == pdf_object::NIL)
+    return "";
+
+  const pdf_object* dict = &parms->second;
+  if (dict->type == pdf_object::ARRAY && dict->array.size() == 1)
+    dict = &dict->array[0];
+  return pdf_unpredict(*dict, data);
+}
+
+std::string pdf_updater::get_stream(uint n, uint generation, const std::string*& data) const {
+  auto key = std::make_pair(n, generation);
+  auto cached = streams.find(key);
+  if (cached != streams.end()) {
+    pdf_stats::count(pdf_stats::STREAM_CACHE_HITS);
+    stream_use.splice(stream_use.begin(), stream_use, cached->second.use);
+    data = &cached->second.data;
+    return "";
+  }
+
+  const auto& stream = get(n, generation);
+  if (stream.type != pdf_object::STREAM)
+    return pdf_error(stream, "not a stream");
+
+  decoded_stream decoded;
+  auto err = get_stream_data(stream, decoded.data);
+  if (!err.empty())
+    return err;
+  pdf_stats::count(pdf_stats::STREAMS_DECODED);
+
+  while (stream_cache_limit && !stream_use.empty() &&
+         streams_size + decoded.data.length() > stream_cache_limit) {
+    auto oldest = streams.find(stream_use.back());
+    streams_size -= oldest->second.data.length();
+    streams.erase(oldest);
+    stream_use.pop_back();
+  }
+
+  // The newest entry is always kept, even if it alone exceeds the limit
+  streams_size += decoded.data.length();
+  stream_use.push_front(key);
+  decoded.use = stream_use.begin();
+  data = &streams.emplace(key, std::move(decoded)).first->second.data;
+  return "";
+}
+
+uint pdf_updater::allocate() {
+  assert(xref_size < UINT_MAX);
+
+  auto n = xref_size++;
+  if (xref.size() < xref_size)
+    xref.resize(xref_size);
+
+  // We don't make sure it gets a subsection in the update yet because we
+  // make no attempts at fixing the linked list of free items either
+  return n;
+}
+
+void pdf_updater::forget(uint n, uint generation) {
+  auto cached = cache.find(std::make_pair(n, generation));
+  if (cached != cache.end()) {
+    cache_size -= cached->second.size;
+    cache.erase(cached);
+  }
+  objstms.erase(n);
+
+  auto decoded = streams.find(std::make_pair(n, generation));
+  if (decoded != streams.end()) {
+    streams_size -= decoded->second.data.length();
+    stream_use.erase(decoded->second.use);
+    streams.erase(decoded);
+  }
+}
+
+void pdf_updater::change(uint n) {
+  if (saved)
+    saved->refs.emplace_back(n, xref.at(n));
+  updated.insert(n);
+}
+
+void pdf_updater::update(uint n, std::function<void()> fill) {
+  change(n);
+  auto& ref = xref.at(n);
+  ref.offset = length() + 1;
+  ref.compressed = 0;
+  ref.free = false;
+  forget(n, ref.generation);
+
+  updates += '\n';
+  pdf_append_decimal(updates, n);
+  updates += ' ';
+  pdf_append_decimal(updates, ref.generation);
+  updates += " obj\n";
+  // Separately so that the callback can use length() to get the current offset
+  fill();
+  updates += "\nendobj";
+}
+
+void pdf_updater::flush_xref_table(const std::map<uint, size_t>& groups) {
+  updates += "\nxref\n";
+  for (const auto& g : groups) {
+    pdf_append_decimal(updates, g.first);
+    updates += ' ';
+    pdf_append_decimal(updates, g.second);
+    updates += '\n';
+    for (size_t i = 0; i < g.second; i++) {
+      // XXX we should warn about any object streams here
+      auto& ref = xref[g.first + i];
+      pdf_append_decimal(updates, ref.offset, 10);
+      updates += ' ';
+      pdf_append_decimal(updates, ref.generation, 5);
+      updates += (ref.free || ref.compressed) ? " f \n" : " n \n";
+    }
+  }
+
+  trailer["Size"] = {pdf_object::NUMERIC, double(xref_size)};
+  updates += "trailer\n";
+  pdf_serialize(trailer, updates);
+}
+
+void pdf_updater::flush_xref_stream(const std::map<uint, size_t>& groups, uint n) {
+  pdf_object index{pdf_object::ARRAY}, stream{pdf_object::STREAM};
+  auto write = [&](unsigned char f1, uint64_t f2, uint64_t f3) {
+    stream.string += char(f1);
+    for (int shift = 56; shift >= 0; shift -= 8)
+      stream.string += char(f2 >> shift);
+    for (int shift = 56; shift >= 0; shift -= 8)
+      stream.string += char(f3 >> shift);
+  };
+  for (const auto& g : groups) {
+    index.array.emplace_back(pdf_object::NUMERIC, double(g.first));
+    index.array.emplace_back(pdf_object::NUMERIC, double(g.second));
+    for (size_t i = 0; i < g.second; i++) {
       auto& ref = xref[g.first + i];
-      document += ssprintf("%010zu %05u %c \n", ref.offset, ref.generation, "nf"[!!ref.free]);
+      if (ref.compressed)
+        write(2, ref.compressed, ref.offset);
+      else
+        write(!ref.free, ref.offset, ref.generation);
+    }
+  }
+
+  trailer["Size"] = {pdf_object::NUMERIC, double(xref_size)};
+  trailer["Index"] = index;
+  trailer["W"] = {pdf_array{
+    {pdf_object::NUMERIC, 1},
+    {pdf_object::NUMERIC, 8},
+    {pdf_object::NUMERIC, 8},
+  }};
+  for (auto key : {"Filter", "DecodeParms", "F", "FFilter", "FDecodeParms", "DL"})
+    trailer.erase(key);
+
+  stream.dict = trailer;
+  updates += '\n';
+  pdf_append_decimal(updates, n);
+  updates += " 0 obj\n";
+  pdf_serialize(stream, updates);
+  updates += "\nendobj";
+}
+
+std::string pdf_updater::flush_updates() {
+  // It does not seem to be possible to upgrade a PDF file from trailer dictionaries
+  // to cross-reference streams, so keep continuity either way.
+  //
+  // (Downgrading from cross-reference streams using XRefStm would not create
+  // a true hybrid-reference file, although it should work.)
+  auto type = trailer.find("Type");
+  bool use_stream = type != trailer.end() && type->second.type == pdf_object::NAME &&
+    type->second.string == "XRef";
+
+  // Cross-reference tables have room for ten digits of offsets, some 9.3 GiB,
+  // whereas streams may use up to eight bytes
+  auto startxref = length() + 1;
+  if (!use_stream && startxref > 9999999999ULL)
+    return "the document is too large for a cross-reference table";
+
+  uint stream_n = 0;
+  if (use_stream) {
+    // The cross-reference stream has to point to itself
+    stream_n = allocate();
+    change(stream_n);
+    auto& ref = xref[stream_n];
+    ref.offset = startxref;
+    ref.free = false;
+  }
+
+  std::map<uint, size_t> groups;
+  for (auto i = updated.cbegin(); i != updated.cend(); ) {
+    size_t start = *i, count = 1;
+    while (++i != updated.cend() && *i == start + count)
+      count++;
+    groups[start] = count;
+  }
+
+  // Taking literally "Each cross-reference section begins with a line containing the keyword xref.
+  // Following this line are one or more cross-reference subsections." from 3.4.3 in PDF Reference
+  if (groups.empty())
+    groups[0] = 0;
+
+  if (use_stream) {
+    flush_xref_stream(groups, stream_n);
+  } else {
+    flush_xref_table(groups);
+  }
+  updates += "\nstartxref\n";
+  pdf_append_decimal(updates, startxref);
+  updates += "\n%%EOF\n";
+
+  // Further updates will chain onto this one
+  trailer["Prev"] = {pdf_object::NUMERIC, double(startxref)};
+  updated.clear();
+  return "";
+}
+
+void pdf_updater::save() {
+  saved.reset(new saved_state);
+  saved->updates_length = updates.length();
+  saved->xref_size = xref_size;
+  saved->updated = updated;
+  saved->trailer = trailer;
+}
+
+void pdf_updater::restore() {
+  assert(saved);
+  for (auto i = saved->refs.crbegin(); i != saved->refs.crend(); i++) {
+    // Whatever may have been parsed from the discarded updates
+    forget(i->first, xref[i->first].generation);
+    xref[i->first] = i->second;
+  }
+  saved->refs.clear();
+
+  updates.resize(saved->updates_length);
+  xref_size = saved->xref_size;
+  updated = saved->updated;
+  trailer = saved->trailer;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+/// Make a PDF object representing the given point in time
+static pdf_object pdf_date(time_t timestamp) {
+  struct tm parts;
+  assert(localtime_r(&timestamp, &parts));
+
+  char buf[64];
+  assert(strftime(buf, sizeof buf, "D:%Y%m%d%H%M%S", &parts));
+
+  std::string offset = "Z";
+  auto offset_min = parts.tm_gmtoff / 60;
+  if (parts.tm_gmtoff < 0)
+    offset = ssprintf("-%02ld'%02ld'", -offset_min / 60, -offset_min % 60);
+  if (parts.tm_gmtoff > 0)
+    offset = ssprintf("+%02ld'%02ld'", +offset_min / 60, +offset_min % 60);
+  return {pdf_object::STRING, buf + offset};
+}
+
+/// Random access to the pages of a document, descending its page tree as guided by /Count.
+/// Nodes are only indexed once they have been descended into, thus for balanced trees,
+/// lookups don't need to touch most page objects.  The index remains valid for as long as
+/// the structure of the page tree doesn't change, as opposed to pages themselves.
+class pdf_page_index {
+  using key = std::pair<uint, uint>;
+
+  /// Kids of a Pages node, along with the running total of pages they contain
+  struct node {
+    std::vector<key> kids;    ///< References to kids
+    std::vector<size_t> ends; ///< Index just past the last page within the respective kid
+  };
+
+  const pdf_updater& pdf;
+  key root = {};                    ///< Reference to the root of the page tree
+  size_t page_count = 0;            ///< Total number of pages
+  std::map<key, node> nodes;        ///< Pages nodes indexed so far
+
+  std::string index_node(const key& ref, const pdf_object& dict, const node*& result);
+
+public:
+  /// Page attributes that Pages nodes may provide for all their descendants
+  static constexpr const char* inheritable[] = {"Resources", "MediaBox", "CropBox", "Rotate"};
+
+  explicit pdf_page_index(const pdf_updater& pdf) : pdf(pdf) {}
+
+  /// Find the page tree of the given document catalog, return an error message on failure
+  std::string initialize(const pdf_object& catalog);
+  /// Return the number of pages in the document, as claimed by the root of the page tree
+  size_t count() const { return page_count; }
+  /// Retrieve a page by its zero-based index, with its number and generation filled in,
+  /// and optionally also collect any attributes it inherits but doesn't specify itself
+  std::string get(size_t index, pdf_object& page, pdf_dict* inherited = nullptr);
+};
+
+constexpr const char* pdf_page_index::inheritable[];
+
+/// Dereference an object if it is a reference, and pass it through otherwise
+static const pdf_object& pdf_dereference(const pdf_updater& pdf, const pdf_object& o) {
+  return o.type == pdf_object::REFERENCE ? pdf.get(o.n, o.generation) : o;
+}
+
+std::string pdf_page_index::initialize(const pdf_object& catalog) {
+  pdf_stats::timer timer(pdf_stats::PAGES);
+  auto pages = catalog.dict.find("Pages");
+  if (pages == catalog.dict.end() || pages->second.type != pdf_object::REFERENCE)
+    return "invalid Pages reference";
+
+  root = {pages->second.n, pages->second.generation};
+  const auto& dict = pdf.get(root.first, root.second);
+  auto count = dict.dict.find("Count");
+  if (dict.type != pdf_object::DICT || count == dict.dict.end())
+    return pdf_error(dict, "invalid or unsupported page tree");
+
+  const auto& value = pdf_dereference(pdf, count->second);
+  if (!value.is_integer() || value.number < 0)
+    return "invalid page tree Count";
+  page_count = value.number;
+  nodes.clear();
+  return "";
+}
+
+std::string pdf_page_index::index_node(const key& ref, const pdf_object& dict,
+    const node*& result) {
+  auto cached = nodes.find(ref);
+  if (cached != nodes.end()) {
+    result = &cached->second;
+    return "";
+  }
+
+  auto kids = dict.dict.find("Kids");
+  if (kids == dict.dict.end())
+    return "missing page tree Kids";
+  const auto& array = pdf_dereference(pdf, kids->second);
+  if (array.type != pdf_object::ARRAY)
+    return "invalid page tree Kids";
+
+  // Collect references first, objects retrieved later may invalidate the array, see get()
+  node indexed;
+  for (const auto& kid : array.array) {
+    if (kid.type != pdf_object::REFERENCE)
+      return "invalid page tree Kids";
+    indexed.kids.emplace_back(kid.n, kid.generation);
+  }
+
+  size_t total = 0;
+  for (const auto& kid : indexed.kids) {
+    // Only Pages nodes know their page count, so all kids need to be looked at
+    const auto& kid_dict = pdf.get(kid.first, kid.second);
+    auto type = kid_dict.dict.find("Type");
+    if (kid_dict.type != pdf_object::DICT ||
+        type == kid_dict.dict.end() || type->second.type != pdf_object::NAME)
+      return pdf_error(kid_dict, "invalid page tree node");
+
+    if (type->second.string == "Page") {
+      total++;
+    } else if (type->second.string == "Pages") {
+      auto count = kid_dict.dict.find("Count");
+      if (count == kid_dict.dict.end())
+        return "missing page tree Count";
+      const auto& value = pdf_dereference(pdf, count->second);
+      if (!value.is_integer() || value.number < 0)
+        return "invalid page tree Count";
+      total += size_t(value.number);
+    } else {
+      return "invalid page tree node";
+    }
+    indexed.ends.push_back(total);
+  }
+  result = &nodes.emplace(ref, std::move(indexed)).first->second;
+  return "";
+}
+
+std::string pdf_page_index::get(size_t index, pdf_object& page, pdf_dict* inherited) {
+  if (index >= page_count)
+    return "page index out of range";
+  if (inherited)
+    *inherited = {};
+
+  // Within each node, the path visits nodes of a strictly decreasing number of pages,
+  // unless Count values are wrong, so a cycle necessarily revisits a node on the path
+  std::set<key> path;
+  for (auto ref = root; ; ) {
+    if (!path.insert(ref).second)
+      return "page tree contains a cycle";
+
+    const auto& dict = pdf.get(ref.first, ref.second);
+    auto type = dict.dict.find("Type");
+    if (dict.type != pdf_object::DICT ||
+        type == dict.dict.end() || type->second.type != pdf_object::NAME)
+      return pdf_error(dict, "invalid page tree node");
+
+    if (type->second.string == "Page") {
+      if (index)
+        return "page tree Count values are inconsistent";
+
+      // Out of convenience; these aren't filled normally
+      page = dict;
+      page.n = ref.first;
+      page.generation = ref.second;
+      if (inherited)
+        for (const auto& key : page.dict)
+          inherited->erase(key.first);
+      return "";
     }
+    if (type->second.string != "Pages")
+      return "invalid page tree node";
+
+    // Values from nodes closer to the page take precedence, which have yet to come
+    if (inherited)
+      for (auto name : inheritable) {
+        auto value = dict.dict.find(name);
+        if (value != dict.dict.end())
+          (*inherited)[name] = value->second;
+      }
+
+    const node* indexed = nullptr;
+    auto err = index_node(ref, dict, indexed);
+    if (!err.empty())
+      return err;
+
+    auto kid = std::upper_bound(indexed->ends.begin(), indexed->ends.end(), index);
+    if (kid == indexed->ends.end())
+      return "page tree Count values are inconsistent";
+
+    auto i = kid - indexed->ends.begin();
+    if (i)
+      index -= indexed->ends[i - 1];
+    ref = indexed->kids[i];
+  }
+}
+
+// -------------------------------------------------------------------------------------------------
+
+/// SHA-256 midstates of whole files, shared by everything signed within a process, so that files
+/// which haven't changed since they were last read or written don't need to be hashed again.
+/// A file is identified by its device, inode, and modification and status change times,
+/// while its size gives the offset that the midstate reaches.  Status change times can't be
+/// set back, so they catch same-sized rewrites that keep or restore the modification time.  Midstates can't be exported from OpenSSL 3.0,
+/// so none of this persists beyond the process.
+class pdf_digest_cache {
+public:
+  /// Device, inode, modification and status change times in seconds and nanoseconds,
+  /// and the size of a file
+  using key = std::tuple<dev_t, ino_t, time_t, long, time_t, long, off_t>;
+
+  /// Make a key for a regular file, return false for anything whose contents aren't trackable
+  static bool identify(const struct stat& st, key& file);
+
+  /// Maximum number of midstates kept, the least recently used ones are dropped first
+  size_t limit = 1024;
+
+  pdf_digest_cache() {}
+  pdf_digest_cache(const pdf_digest_cache&) = delete;
+  pdf_digest_cache& operator=(const pdf_digest_cache&) = delete;
+  ~pdf_digest_cache();
+
+  /// Copy the midstate of the given file into the context, returning whether it was known
+  bool find(const key& file, EVP_MD_CTX* target);
+  /// Remember the midstate of the given file
+  void store(const key& file, const EVP_MD_CTX* ctx);
+
+private:
+  struct entry {
+    EVP_MD_CTX* ctx;                ///< Copy of the midstate
+    std::list<key>::iterator use;   ///< Position in the use list
+  };
+
+  std::mutex mutex;                 ///< Protects everything below
+  std::map<key, entry> entries;     ///< Midstates indexed by file
+  std::list<key> use;               ///< Keys of all entries, most recently used first
+};
+
+bool pdf_digest_cache::identify(const struct stat& st, key& file) {
+  if (!S_ISREG(st.st_mode))
+    return false;
+  file = key{st.st_dev, st.st_ino, st.st_mtim.tv_sec, st.st_mtim.tv_nsec,
+             st.st_ctim.tv_sec, st.st_ctim.tv_nsec, st.st_size};
+  return true;
+}
+
+pdf_digest_cache::~pdf_digest_cache() {
+  for (auto& i : entries)
+    EVP_MD_CTX_free(i.second.ctx);
+}
+
+bool pdf_digest_cache::find(const key& file, EVP_MD_CTX* target) {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto i = entries.find(file);
+  if (i == entries.end())
+    return false;
+  use.splice(use.begin(), use, i->second.use);
+  return EVP_MD_CTX_copy_ex(target, i->second.ctx);
+}
+
+void pdf_digest_cache::store(const key& file, const EVP_MD_CTX* ctx) {
+  auto copy = EVP_MD_CTX_new();
+  if (!copy || !EVP_MD_CTX_copy_ex(copy, ctx)) {
+    EVP_MD_CTX_free(copy);
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+  auto i = entries.find(file);
+  if (i != entries.end()) {
+    EVP_MD_CTX_free(i->second.ctx);
+    use.erase(i->second.use);
+    entries.erase(i);
+  }
+  while (!use.empty() && entries.size() >= limit) {
+    i = entries.find(use.back());
+    EVP_MD_CTX_free(i->second.ctx);
+    entries.erase(i);
+    use.pop_back();
+  }
+
+  use.push_front(file);
+  entries.emplace(file, entry{copy, use.begin()});
+}
+
+/// SHA-256 digest of the original document, which doesn't depend on the update in any way,
+/// and can therefore be computed in a background thread while the update is being built.
+/// It may later be extended by finished updates, so that further signatures, which cover
+/// everything that precedes them, only need to hash whatever is new.
+class pdf_digest {
+  EVP_MD_CTX* ctx = nullptr;
+  std::thread worker;
+  size_t hashed = 0;
+  bool ok = false;
+
+  pdf_digest_cache* cache = nullptr;  ///< Where to store the digest of the document, if anywhere
+  pdf_digest_cache::key file;         ///< The document's key within the cache
+  pdf_stats* stats = nullptr;         ///< Where to record hashing, which may run in another thread
+
+  void run(const char* data, size_t length);
+
+public:
+  /// Documents smaller than this aren't worth spawning a thread for
+  static constexpr size_t background_threshold = 1 << 20;
+
+  /// Start hashing the document, unless the cache, if any, already knows its midstate
+  pdf_digest(const char* data, size_t length,
+             pdf_digest_cache* cache = nullptr, const pdf_digest_cache::key& file = {});
+  pdf_digest(const pdf_digest&) = delete;
+  pdf_digest& operator=(const pdf_digest&) = delete;
+  ~pdf_digest();
+
+  /// Return the number of bytes from the start of the document that the digest covers
+  size_t length() const { return hashed; }
+  /// Wait for the digest to finish, and continue from its state in the given context
+  bool resume(EVP_MD_CTX* target);
+  /// Wait for the digest to finish, and extend it by data immediately following what it covers
+  bool extend(const char* data, size_t length);
+  /// Wait for the digest to finish, and store it in the cache for a file with the same contents
+  void checkpoint(pdf_digest_cache& cache, const pdf_digest_cache::key& file);
+};
+
+pdf_digest::pdf_digest(const char* data, size_t length,
+    pdf_digest_cache* cache, const pdf_digest_cache::key& file)
+  : ctx(EVP_MD_CTX_new()), hashed(length), cache(cache), file(file), stats(pdf_stats::current) {
+  if (ctx && cache && cache->find(file, ctx))
+    ok = true, pdf_stats::count(pdf_stats::DIGEST_CACHE_HITS);
+  else if (length < background_threshold)
+    run(data, length);
+  else
+    worker = std::thread(&pdf_digest::run, this, data, length);
+}
+
+pdf_digest::~pdf_digest() {
+  if (worker.joinable())
+    worker.join();
+  EVP_MD_CTX_free(ctx);
+}
+
+void pdf_digest::run(const char* data, size_t length) {
+  pdf_stats::timer timer(pdf_stats::HASH, stats);
+  pdf_stats::count(pdf_stats::BYTES_HASHED, length, stats);
+  ok = ctx && EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr) &&
+    EVP_DigestUpdate(ctx, data, length);
+  if (ok && cache)
+    cache->store(file, ctx);
+}
+
+bool pdf_digest::resume(EVP_MD_CTX* target) {
+  if (worker.joinable())
+    worker.join();
+  return ok && EVP_MD_CTX_copy_ex(target, ctx);
+}
+
+bool pdf_digest::extend(const char* data, size_t length) {
+  if (worker.joinable())
+    worker.join();
+  pdf_stats::timer timer(pdf_stats::HASH, stats);
+  pdf_stats::count(pdf_stats::BYTES_HASHED, length, stats);
+  hashed += length;
+  return ok = ok && EVP_DigestUpdate(ctx, data, length);
+}
+
+void pdf_digest::checkpoint(pdf_digest_cache& cache, const pdf_digest_cache::key& file) {
+  if (worker.joinable())
+    worker.join();
+  if (ok)
+    cache.store(file, ctx);
+}
+
+/// Append reasons from the OpenSSL error stack (it's a queue, really) to any error message,
+/// and clear it in the process to avoid confusion elsewhere
+static std::string openssl_error(std::string err) {
+  if (err.empty()) {
+    ERR_clear_error();
+    return err;
+  }
+  while (auto code = ERR_get_error())
+    if (auto reason = ERR_reason_error_string(code))
+      err = err + "; " + reason;
+  return err;
+}
+
+/// Anything that can produce SHA-256 signatures to go with its certificate and chain,
+/// used read-only for any number of signatures.  Implementations must allow concurrent calls
+/// to sign(), so that slow devices may work on several signatures at once.
+struct pdf_signer {
+  X509* certificate = nullptr;
+  STACK_OF(X509)* chain = nullptr;
+
+  pdf_signer() {}
+  pdf_signer(const pdf_signer&) = delete;
+  pdf_signer& operator=(const pdf_signer&) = delete;
+  virtual ~pdf_signer();
+
+  /// Sign the SHA-256 digest of the given data, returning an error message on failure,
+  /// after which the OpenSSL error stack may hold further details
+  virtual std::string sign(const unsigned char* data, size_t length,
+                           std::string& signature) const = 0;
+  /// Check whether the certificate is suitable for document signatures
+  std::string check() const;
+  /// Estimate the length of a DER-encoded signature, erring on the side of caution
+  size_t estimate_signature_length() const;
+};
+
+pdf_signer::~pdf_signer() {
+  sk_X509_pop_free(chain, X509_free);
+  X509_free(certificate);
+}
+
+std::string pdf_signer::check() const {
+  if (!(X509_get_key_usage(certificate) & (KU_DIGITAL_SIGNATURE | KU_NON_REPUDIATION)))
+    // Prevent useless signatures -- makes pdfsig from poppler happy at least (and NSS by extension)
+    return "the certificate's key usage must include digital signatures or non-repudiation";
+  if (!(X509_get_extended_key_usage(certificate) & (XKU_SMIME | XKU_ANYEKU)))
+    return "the certificate's extended key usage must include S/MIME";
+#if 0  // This happily ignores XKU_ANYEKU and I want my tiny world to make a tiny bit more sense
+  if (X509_check_purpose(certificate, X509_PURPOSE_SMIME_SIGN, false /* not a CA cert. */))
+    return "the certificate can't be used for S/MIME digital signatures";
+#endif
+  return "";
+}
+
+size_t pdf_signer::estimate_signature_length() const {
+  // ASN.1 framing, algorithm identifiers, and signed attributes take up roughly 200 bytes
+  size_t length = 256 + EVP_PKEY_size(X509_get0_pubkey(certificate)) +
+    i2d_X509_NAME(X509_get_issuer_name(certificate), nullptr) +
+    i2d_ASN1_INTEGER(X509_get_serialNumber(certificate), nullptr) +
+    i2d_X509(certificate, nullptr);
+  for (int i = 0; i < sk_X509_num(chain); i++)
+    length += i2d_X509(sk_X509_value(chain, i), nullptr);
+  return length;
+}
+
+/// A signer backed by an EVP_PKEY, which may either be held in memory, or refer to a key
+/// that never leaves a hardware token, such as with PKCS#11 through an OpenSSL provider
+struct pdf_key_signer : pdf_signer {
+  EVP_PKEY* private_key = nullptr;
+
+  ~pdf_key_signer() override { EVP_PKEY_free(private_key); }
+
+  /// Load and check a key pair in the PKCS#12 format, returning an error message on failure
+  std::string load_pkcs12(const std::string& path, const std::string& pass);
+  /// Load and check a key pair from an OSSL_STORE URI, such as "pkcs11:..." or "file:...",
+  /// where the password doubles as a PIN, returning an error message on failure
+  std::string load_store(const std::string& uri, const std::string& pass);
+
+  std::string sign(const unsigned char* data, size_t length,
+                   std::string& signature) const override;
+};
+
+std::string pdf_key_signer::load_pkcs12(const std::string& path, const std::string& pass) {
+  if (path.empty())
+    return "undefined path to the signing key";
+
+  auto pkcs12_fp = fopen(path.c_str(), "r");
+  if (!pkcs12_fp)
+    return path + ": " + strerror(errno);
+
+  // Abandon hope, all ye who enter OpenSSL!  Half of it is undocumented.
+  OpenSSL_add_all_algorithms();
+  ERR_load_crypto_strings();
+  ERR_clear_error();
+
+  PKCS12* p12 = nullptr;
+  std::string err;
+  if (!(p12 = d2i_PKCS12_fp(pkcs12_fp, nullptr)) ||
+      !PKCS12_parse(p12, pass.c_str(), &private_key, &certificate, &chain))
+    err = path + ": parse failure";
+  else if (!private_key || !certificate)
+    err = path + ": must contain a private key and a valid certificate chain";
+  else
+    err = check();
+
+  PKCS12_free(p12);
+  fclose(pkcs12_fp);
+  return openssl_error(err);
+}
+
+/// Hands out the password to OSSL_STORE loaders, which ask for it as necessary
+static int pdf_key_signer_pass_cb(char* buf, int size, int, void* userdata) {
+  auto pass = static_cast<const std::string*>(userdata);
+  int len = std::min(int(pass->length()), size);
+  memcpy(buf, pass->data(), len);
+  return len;
+}
+
+std::string pdf_key_signer::load_store(const std::string& uri, const std::string& pass) {
+  OpenSSL_add_all_algorithms();
+  ERR_load_crypto_strings();
+  ERR_clear_error();
+
+  UI_METHOD* ui = nullptr;
+  OSSL_STORE_CTX* store = nullptr;
+  STACK_OF(X509)* certificates = nullptr;
+  std::string err = uri + ": OpenSSL failure";
+  if (!(ui = UI_UTIL_wrap_read_pem_callback(pdf_key_signer_pass_cb, 0)) ||
+      !(certificates = sk_X509_new_null()) ||
+      !(store = OSSL_STORE_open(uri.c_str(), ui, const_cast<std::string*>(&pass),
+                                nullptr, nullptr)))
+    goto error;
+
+  // The URI may name the key and its certificates separately, but it's easier to take
+  // everything it matches, and figure out the certificate from the key
+  while (!OSSL_STORE_eof(store)) {
+    auto info = OSSL_STORE_load(store);
+    if (!info) {
+      // Some loaders flag an error upon reaching the end
+      if (OSSL_STORE_error(store) && !OSSL_STORE_eof(store))
+        goto error;
+      continue;
+    }
+    if (OSSL_STORE_INFO_get_type(info) == OSSL_STORE_INFO_PKEY && !private_key)
+      private_key = OSSL_STORE_INFO_get1_PKEY(info);
+    if (OSSL_STORE_INFO_get_type(info) == OSSL_STORE_INFO_CERT) {
+      auto cert = OSSL_STORE_INFO_get1_CERT(info);
+      if (!cert || !sk_X509_push(certificates, cert)) {
+        X509_free(cert);
+        OSSL_STORE_INFO_free(info);
+        goto error;
+      }
+    }
+    OSSL_STORE_INFO_free(info);
+  }
+
+  chain = sk_X509_new_null();
+  for (int i = 0; chain && i < sk_X509_num(certificates); i++) {
+    auto cert = sk_X509_value(certificates, i);
+    if (!certificate && private_key && X509_check_private_key(cert, private_key))
+      certificate = cert;
+    else if (!sk_X509_push(chain, cert))
+      goto error;
+    sk_X509_set(certificates, i, nullptr);
+  }
+  // Mismatches leave errors behind that would only make any further failures confusing
+  ERR_clear_error();
+
+  if (!chain)
+    goto error;
+  if (!private_key || !certificate)
+    err = uri + ": must contain a private key and a matching certificate";
+  else
+    err = check();
+
+error:
+  sk_X509_pop_free(certificates, X509_free);
+  OSSL_STORE_close(store);
+  UI_destroy_method(ui);
+  return openssl_error(err);
+}
+
+std::string pdf_key_signer::sign(const unsigned char* data, size_t length,
+    std::string& signature) const {
+  EVP_MD_CTX* ctx = nullptr;
+  size_t len = 0;
+  std::string err = "OpenSSL failure";
+  if (!(ctx = EVP_MD_CTX_new()) ||
+      !EVP_DigestSignInit(ctx, nullptr, EVP_sha256(), nullptr, private_key) ||
+      !EVP_DigestSign(ctx, nullptr, &len, data, length))
+    goto error;
+
+  signature.resize(len);
+  if (!EVP_DigestSign(ctx, reinterpret_cast<unsigned char*>(&signature[0]), &len, data, length))
+    goto error;
+
+  signature.resize(len);
+  err.clear();
+
+error:
+  EVP_MD_CTX_free(ctx);
+  return err;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+/// Send out all the given buffers, without raising SIGPIPE
+static bool send_all(int fd, std::vector<struct iovec> iov) {
+  for (size_t i = 0; i < iov.size(); ) {
+    struct msghdr msg = {};
+    msg.msg_iov = &iov[i];
+    msg.msg_iovlen = std::min(iov.size() - i, size_t(IOV_MAX));
+
+    auto n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return false;
+
+    for (; i < iov.size() && size_t(n) >= iov[i].iov_len; i++)
+      n -= iov[i].iov_len;
+    if (i < iov.size()) {
+      iov[i].iov_base = static_cast<char*>(iov[i].iov_base) + n;
+      iov[i].iov_len -= n;
+    }
+  }
+  return true;
+}
+
+/// RFC 3161 Time-Stamp Protocol client, talking to a time-stamping authority over HTTP/1.1.
+/// Connections are kept alive for reuse, and any number of threads may request timestamps at once,
+/// each over a connection of its own, so that their round-trips don't wait for each other.
+class pdf_tsa {
+  std::string host, port, path;           ///< Parts of the URL
+  std::mutex mutex;                       ///< Protects idle
+  std::vector<int> idle;                  ///< Open connections that are ready to be reused
+  std::atomic<size_t> last_token_length;  ///< Length of the most recently received token
+
+  std::string connect(int& fd);
+  std::string post(int fd, const std::string& query, std::string& response, bool& reusable);
+  std::string request(const std::string& query, std::string& response);
+
+public:
+  /// How long to wait for the TSA at any point, in seconds
+  static constexpr int timeout = 30;
+
+  pdf_tsa() : last_token_length(8192) {}
+  pdf_tsa(const pdf_tsa&) = delete;
+  pdf_tsa& operator=(const pdf_tsa&) = delete;
+  ~pdf_tsa();
+
+  /// Set the URL of the TSA, which must use plain HTTP, returning an error message on failure
+  std::string set_url(const std::string& url);
+  /// Estimate the length of a DER-encoded timestamp token, based on the last one received
+  size_t estimate_token_length() const { return last_token_length + 64; }
+  /// Retrieve a DER-encoded timestamp token for the given data, returning an error message
+  /// on failure, after which the OpenSSL error stack may hold further details
+  std::string stamp(const unsigned char* data, size_t length, std::string& token);
+};
+
+pdf_tsa::~pdf_tsa() {
+  for (auto fd : idle)
+    close(fd);
+}
+
+std::string pdf_tsa::set_url(const std::string& url) {
+  static const std::string scheme = "http://";
+  if (url.compare(0, scheme.length(), scheme))
+    return url + ": only HTTP URLs are supported";
+
+  auto authority_end = url.find('/', scheme.length());
+  auto authority = url.substr(scheme.length(), authority_end - scheme.length());
+  path = authority_end == std::string::npos ? "/" : url.substr(authority_end);
+
+  // IPv6 addresses are enclosed in brackets, as they contain colons themselves
+  auto host_end = authority.find(']');
+  auto colon = authority.find(':', host_end == std::string::npos ? 0 : host_end);
+  host = authority.substr(0, colon);
+  port = colon == std::string::npos ? "80" : authority.substr(colon + 1);
+  if (host.length() > 1 && host.front() == '[' && host.back() == ']')
+    host = host.substr(1, host.length() - 2);
+  if (host.empty() || port.empty())
+    return url + ": invalid URL";
+  return "";
+}
+
+std::string pdf_tsa::connect(int& fd) {
+  struct addrinfo hints = {}, * result = nullptr;
+  hints.ai_socktype = SOCK_STREAM;
+  if (int gai = getaddrinfo(host.c_str(), port.c_str(), &hints, &result))
+    return gai_strerror(gai);
+
+  std::string err = "no usable addresses";
+  for (auto ai = result; ai && fd == -1; ai = ai->ai_next) {
+    // The send timeout also applies to connect() on Linux
+    struct timeval tv = {timeout, 0};
+    fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+    if (fd != -1 && !setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv) &&
+        !setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv) &&
+        !::connect(fd, ai->ai_addr, ai->ai_addrlen))
+      break;
+
+    err = strerror(errno);
+    if (fd != -1)
+      close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(result);
+  return fd == -1 ? err : "";
+}
+
+/// Send a query over an HTTP/1.1 connection and receive the body of the response,
+/// which must have been successful, and find out whether the connection can be reused
+std::string pdf_tsa::post(int fd, const std::string& query, std::string& response,
+    bool& reusable) {
+  auto authority = (host.find(':') == std::string::npos ? host : "[" + host + "]") + ":" + port;
+  auto header = ssprintf("POST %s HTTP/1.1\r\nHost: %s\r\n"
+                         "Content-Type: application/timestamp-query\r\n"
+                         "Content-Length: %zu\r\n\r\n",
+                         path.c_str(), authority.c_str(), query.length());
+  if (!send_all(fd, {{&header[0], header.length()},
+                     {const_cast<char*>(query.data()), query.length()}}))
+    return strerror(errno);
+
+  std::string buffer;
+  auto receive = [&] {
+    char buf[1 << 14];
+    while (1) {
+      auto n = recv(fd, buf, sizeof buf, 0);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return false;
+      buffer.append(buf, n);
+      return true;
+    }
+  };
+
+  size_t header_end = 0;
+  while ((header_end = buffer.find("\r\n\r\n")) == std::string::npos)
+    if (!receive())
+      return "connection closed";
+
+  // Header field names are case-insensitive, and so are the values we're interested in
+  std::string lowercase;
+  for (size_t i = 0; i < header_end; i++)
+    lowercase += tolower(buffer[i]);
+
+  int status = 0;
+  if (sscanf(lowercase.c_str(), "http/1.%*d %d", &status) != 1)
+    return "invalid response";
+
+  bool chunked = false, has_length = false;
+  size_t length = 0;
+  reusable = !lowercase.compare(0, 8, "http/1.1");
+  for (size_t i = lowercase.find("\r\n"); i != std::string::npos; ) {
+    auto end = lowercase.find("\r\n", i + 2);
+    auto field = lowercase.substr(i + 2, end - i - 2);
+    if (field.compare(0, 15, "content-length:") == 0)
+      has_length = true, length = strtoull(field.c_str() + 15, nullptr, 10);
+    if (field.compare(0, 18, "transfer-encoding:") == 0)
+      chunked = field.find("chunked") != std::string::npos;
+    if (field.compare(0, 11, "connection:") == 0 && field.find("close") != std::string::npos)
+      reusable = false;
+    i = end;
+  }
+
+  buffer.erase(0, header_end + 4);
+  response.clear();
+  if (chunked) {
+    while (1) {
+      size_t line_end = 0;
+      while ((line_end = buffer.find("\r\n")) == std::string::npos)
+        if (!receive())
+          return "truncated response";
+      auto chunk = strtoull(buffer.c_str(), nullptr, 16);
+      if (!chunk) {
+        // Trailer fields aren't supported, there should be no reason to send any
+        buffer.erase(0, line_end + 2);
+        while (buffer.length() < 2)
+          if (!receive())
+            return "truncated response";
+        break;
+      }
+      while (buffer.length() < line_end + 2 + chunk + 2)
+        if (!receive())
+          return "truncated response";
+      response.append(buffer, line_end + 2, chunk);
+      buffer.erase(0, line_end + 2 + chunk + 2);
+    }
+  } else if (has_length) {
+    while (buffer.length() < length)
+      if (!receive())
+        return "truncated response";
+    response = buffer.substr(0, length);
+  } else {
+    while (receive())
+      ;
+    response = buffer;
+    reusable = false;
+  }
+
+  if (status != 200)
+    return ssprintf("HTTP status %d", status);
+  return "";
+}
+
+/// Exchange a query for a response, preferring an idle connection, and retrying once
+/// with a new one should it turn out to have been closed in the meantime
+std::string pdf_tsa::request(const std::string& query, std::string& response) {
+  int fd = -1;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!idle.empty()) {
+      fd = idle.back();
+      idle.pop_back();
+    }
+  }
+
+  std::string err;
+  bool reusable = false;
+  if (fd == -1 || !(err = post(fd, query, response, reusable)).empty()) {
+    if (fd != -1)
+      close(fd);
+    fd = -1;
+    if ((err = connect(fd)).empty())
+      err = post(fd, query, response, reusable);
+  }
+
+  if (fd != -1 && err.empty() && reusable) {
+    std::lock_guard<std::mutex> lock(mutex);
+    idle.push_back(fd);
+  } else if (fd != -1) {
+    close(fd);
+  }
+  return err.empty() ? err : host + ": " + err;
+}
+
+std::string pdf_tsa::stamp(const unsigned char* data, size_t length, std::string& token) {
+  unsigned char digest[EVP_MAX_MD_SIZE] = {};
+  unsigned int digest_len = 0;
+  TS_REQ* req = nullptr;
+  TS_MSG_IMPRINT* imprint = nullptr;
+  X509_ALGOR* algorithm = nullptr;
+  BIGNUM* random = nullptr;
+  ASN1_INTEGER* nonce = nullptr;
+  TS_RESP* resp = nullptr;
+  TS_VERIFY_CTX* verify = nullptr;
+  const unsigned char* p = nullptr;
+  unsigned char* buf = nullptr;
+  int len = 0;
+  std::string query, response;
+
+  // The nonce prevents replays, the certificate is needed by anyone who is to verify the token
+  std::string err = "OpenSSL failure";
+  if (!EVP_Digest(data, length, digest, &digest_len, EVP_sha256(), nullptr) ||
+      !(req = TS_REQ_new()) || !TS_REQ_set_version(req, 1) ||
+      !(imprint = TS_MSG_IMPRINT_new()) || !(algorithm = X509_ALGOR_new()) ||
+      !X509_ALGOR_set0(algorithm, OBJ_nid2obj(NID_sha256), V_ASN1_NULL, nullptr) ||
+      !TS_MSG_IMPRINT_set_algo(imprint, algorithm) ||
+      !TS_MSG_IMPRINT_set_msg(imprint, digest, digest_len) ||
+      !TS_REQ_set_msg_imprint(req, imprint) ||
+      !(random = BN_new()) || !BN_rand(random, 64, BN_RAND_TOP_ANY, BN_RAND_BOTTOM_ANY) ||
+      !(nonce = BN_to_ASN1_INTEGER(random, nullptr)) || !TS_REQ_set_nonce(req, nonce) ||
+      !TS_REQ_set_cert_req(req, 1) || (len = i2d_TS_REQ(req, &buf)) < 0)
+    goto error;
+
+  query.assign(reinterpret_cast<const char*>(buf), len);
+  if (!(err = request(query, response)).empty())
+    goto error;
+
+  p = reinterpret_cast<const unsigned char*>(response.data());
+  if (!(resp = d2i_TS_RESP(nullptr, &p, response.length()))) {
+    err = host + ": invalid timestamp response";
+    goto error;
+  }
+  // 0 stands for granted, 1 for granted with modifications, anything else is a failure
+  if (ASN1_INTEGER_get(TS_STATUS_INFO_get0_status(TS_RESP_get_status_info(resp))) > 1) {
+    err = host + ": the timestamp request has been rejected";
+    auto text = TS_STATUS_INFO_get0_text(TS_RESP_get_status_info(resp));
+    if (sk_ASN1_UTF8STRING_num(text) > 0) {
+      auto reason = sk_ASN1_UTF8STRING_value(text, 0);
+      err += ": " + std::string(reinterpret_cast<const char*>(ASN1_STRING_get0_data(reason)),
+                                ASN1_STRING_length(reason));
+    }
+    goto error;
+  }
+
+  // This matches the response against the request, though it doesn't verify its signature
+  err = host + ": invalid timestamp response";
+  if (!(verify = TS_REQ_to_TS_VERIFY_CTX(req, nullptr)) || !TS_RESP_verify_response(verify, resp))
+    goto error;
+
+  OPENSSL_free(buf);
+  buf = nullptr;
+  if ((len = i2d_PKCS7(TS_RESP_get_token(resp), &buf)) < 0)
+    goto error;
+
+  token.assign(reinterpret_cast<const char*>(buf), len);
+  last_token_length = token.length();
+  err.clear();
+
+error:
+  OPENSSL_free(buf);
+  TS_VERIFY_CTX_free(verify);
+  TS_RESP_free(resp);
+  ASN1_INTEGER_free(nonce);
+  BN_free(random);
+  X509_ALGOR_free(algorithm);
+  TS_MSG_IMPRINT_free(imprint);
+  TS_REQ_free(req);
+  return err;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+// /All/ bytes are checked, except for the signature hexstring itself, which must lie in the updates.
+// The digest of the document's beginning is taken over as it is.
+static std::string pdf_digest_signed_ranges(const pdf_updater& pdf, pdf_digest& digest,
+    size_t sign_off, size_t sign_len, std::string& md) {
+  pdf_stats::timer timer(pdf_stats::DIGEST);
+  size_t tail_off = sign_off + sign_len, tail_len = pdf.length() - tail_off;
+  size_t hashed = digest.length() - pdf.document_length;
+  assert(digest.length() >= pdf.document_length && sign_off >= digest.length());
+  pdf_stats::count(pdf_stats::BYTES_HASHED, sign_off - digest.length() + tail_len);
+  ERR_clear_error();
+
+  // The document digest is finished here, rather than by PKCS7_dataFinal(), which would insist
+  // on signing it with an EVP_PKEY of its own, synchronously
+  EVP_MD_CTX* md_ctx = nullptr;
+  unsigned char buf[EVP_MAX_MD_SIZE] = {};
+  unsigned int len = 0;
+  std::string err = "OpenSSL failure";
+  if ((md_ctx = EVP_MD_CTX_new()) && digest.resume(md_ctx) &&
+      EVP_DigestUpdate(md_ctx, pdf.updates.data() + hashed, sign_off - digest.length()) &&
+      EVP_DigestUpdate(md_ctx, pdf.updates.data() + tail_off - pdf.document_length, tail_len) &&
+      EVP_DigestFinal_ex(md_ctx, buf, &len)) {
+    md.assign(reinterpret_cast<const char*>(buf), len);
+    err.clear();
+  }
+  EVP_MD_CTX_free(md_ctx);
+  return openssl_error(err);
+}
+
+/// Encode the signed attributes of a signature of a document with the message digest `md',
+/// the same ones that PKCS7_sign() would add with PKCS7_NOSMIMECAP.  What a signer signs is
+/// their DER encoding as a SET OF.
+static std::string pdf_signed_attributes(const std::string& md, std::string& attributes) {
+  ERR_clear_error();
+
+  PKCS7_SIGNER_INFO* signer_info = nullptr;
+  unsigned char* buf = nullptr;
+  int len = 0;
+  std::string err = "OpenSSL failure";
+  if ((signer_info = PKCS7_SIGNER_INFO_new()) &&
+      PKCS7_add_signed_attribute(signer_info, NID_pkcs9_contentType, V_ASN1_OBJECT,
+                                 OBJ_nid2obj(NID_pkcs7_data)) &&
+      PKCS7_add0_attrib_signing_time(signer_info, nullptr) &&
+      PKCS7_add1_attrib_digest(signer_info,
+                               reinterpret_cast<const unsigned char*>(md.data()), md.length()) &&
+      (len = ASN1_item_i2d(reinterpret_cast<ASN1_VALUE*>(signer_info->auth_attr), &buf,
+                           ASN1_ITEM_rptr(PKCS7_ATTR_SIGN))) >= 0) {
+    attributes.assign(reinterpret_cast<const char*>(buf), len);
+    err.clear();
+  }
+  OPENSSL_free(buf);
+  PKCS7_SIGNER_INFO_free(signer_info);
+  return openssl_error(err);
+}
+
+/// Build a detached SignedData with a single SignerInfo around the given DER-encoded signed
+/// attributes, and store it DER-encoded in `result'.  A TSA may be used to timestamp it.
+static std::string pdf_build_signature(const pdf_signer& signer, const std::string& attributes,
+    pdf_tsa* tsa, std::string& result) {
+  ERR_clear_error();
+
+  PKCS7* p7 = nullptr;
+  PKCS7_SIGNER_INFO* signer_info = nullptr;
+  STACK_OF(X509_ATTRIBUTE)* attrs = nullptr;
+  auto p = reinterpret_cast<const unsigned char*>(attributes.data());
+  unsigned char* buf = nullptr;
+  int len = 0;
+  ASN1_STRING* token_value = nullptr;
+  std::string signature, token;
+
+  // OpenSSL error reasons will usually be of more value than any distinction I can come up with
+  std::string err = "OpenSSL failure";
+  if (!(p7 = PKCS7_new()) || !PKCS7_set_type(p7, NID_pkcs7_signed) ||
+      !PKCS7_content_new(p7, NID_pkcs7_data) || !PKCS7_set_detached(p7, 1) ||
+      !(signer_info = PKCS7_add_signature(p7, signer.certificate,
+                                          X509_get0_pubkey(signer.certificate), EVP_sha256())) ||
+      !PKCS7_add_certificate(p7, signer.certificate))
+    goto error;
+  for (int i = 0; i < sk_X509_num(signer.chain); i++)
+    if (!PKCS7_add_certificate(p7, sk_X509_value(signer.chain, i)))
+      goto error;
+  if (!(attrs = reinterpret_cast<STACK_OF(X509_ATTRIBUTE)*>(ASN1_item_d2i(nullptr, &p,
+          attributes.length(), ASN1_ITEM_rptr(PKCS7_ATTR_SIGN)))) ||
+      !PKCS7_set_signed_attributes(signer_info, attrs))
+    goto error;
+
+  {
+    pdf_stats::timer timer(pdf_stats::SIGN);
+    err = signer.sign(reinterpret_cast<const unsigned char*>(attributes.data()),
+                      attributes.length(), signature);
+  }
+  if (!err.empty())
+    goto error;
+
+  err = "OpenSSL failure";
+  if (!ASN1_STRING_set(signer_info->enc_digest, signature.data(), signature.length()))
+    goto error;
+
+  // RFC 3161 Appendix A: the timestamp token covers the signature value,
+  // and goes in an unsigned attribute of the signer
+  if (tsa) {
+    pdf_stats::timer timer(pdf_stats::TIMESTAMP);
+    if (!(err = tsa->stamp(signer_info->enc_digest->data, signer_info->enc_digest->length,
+                           token)).empty())
+      goto error;
+
+    err = "OpenSSL failure";
+    if (!(token_value = ASN1_STRING_new()) ||
+        !ASN1_STRING_set(token_value, token.data(), token.length()) ||
+        !PKCS7_add_attribute(signer_info, NID_id_smime_aa_timeStampToken,
+                             V_ASN1_SEQUENCE, token_value))
+      goto error;
+    token_value = nullptr;
+  }
+
+#if 0
+  {
+    // Debugging: openssl cms -inform PEM -in pdf_signature.pem -noout -cmsout -print
+    // Context: https://stackoverflow.com/a/29253469
+    auto fp = fopen("pdf_signature.pem", "wb");
+    assert(PEM_write_PKCS7(fp, p7) && !fclose(fp));
+  }
+#endif
+
+  if ((len = i2d_PKCS7(p7, &buf)) < 0)
+    goto error;
+  result.assign(reinterpret_cast<const char*>(buf), len);
+  err.clear();
+
+error:
+  ASN1_STRING_free(token_value);
+  OPENSSL_free(buf);
+  sk_X509_ATTRIBUTE_pop_free(attrs, X509_ATTRIBUTE_free);
+  PKCS7_free(p7);
+  return openssl_error(err);
+}
+
+/// Encode data in lowercase hexadecimal digits
+static std::string pdf_hex(const std::string& data) {
+  std::string hex;
+  for (unsigned char c : data) {
+    hex += "0123456789abcdef"[c / 16];
+    hex += "0123456789abcdef"[c % 16];
+  }
+  return hex;
+}
+
+/// Encode a DER-encoded signature for a hexstring of `sign_len' bytes, including the quotes.
+/// When the signature doesn't fit, its actual length in bytes is stored in `required'.
+static std::string pdf_encode_signature(const std::string& signature, size_t sign_len,
+    size_t& required, std::string& hex) {
+  if (signature.length() * 2 > sign_len - 2 /* hexstring quotes */) {
+    // The obvious solution is to increase the allocation... or spend a week reading specifications
+    // while losing all faith in humanity as a species, and skip the PKCS7 API entirely
+    required = signature.length();
+    return ssprintf("not enough space reserved for the signature (%zu nibbles vs %zu nibbles)",
+                    sign_len - 2, signature.length() * 2);
+  }
+  hex = pdf_hex(signature);
+  return "";
+}
+
+// Sign the message digest `md' of the document, and write the signature into its hexstring.
+// When the signature doesn't fit, its actual length in bytes is stored in `required'.
+// A TSA may be used to timestamp it.
+static std::string pdf_fill_in_signature(pdf_updater& pdf, const pdf_signer& signer,
+    const std::string& md, size_t sign_off, size_t sign_len, size_t& required, pdf_tsa* tsa) {
+  std::string attributes, signature, hex;
+  auto err = pdf_signed_attributes(md, attributes);
+  if (err.empty())
+    err = pdf_build_signature(signer, attributes, tsa, signature);
+  if (err.empty())
+    err = pdf_encode_signature(signature, sign_len, required, hex);
+  if (err.empty())
+    pdf.updates.replace(sign_off - pdf.document_length + 1, hex.length(), hex);
+  return err;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+/// Parameters of pdf_sign()
+struct pdf_sign_options {
+  ushort reservation = 4096;  ///< Reserved space in bytes for the certificate, digest, ...
+  long page = 1;              ///< Page to attach the signature to, may count back from -1
+  bool auto_reserve = false;  ///< Estimate the reservation instead, and fix it up if needed
+  pdf_tsa* tsa = nullptr;     ///< Where to get RFC 3161 timestamps from, if anywhere
+};
+
+/// Append a reference to an array, which is either held directly by the given dictionary entry,
+/// in which case it may also be missing, or referenced by it, in which case it gets updated
+static std::string pdf_append_reference(pdf_updater& pdf, pdf_object& entry, uint n,
+    const char* what) {
+  if (entry.type == pdf_object::END)
+    entry = {pdf_object::ARRAY};
+  if (entry.type == pdf_object::ARRAY) {
+    entry.array.emplace_back(pdf_object::REFERENCE, n, 0);
+    return "";
+  }
+  if (entry.type != pdf_object::REFERENCE)
+    return ssprintf("unexpected %s", what);
+
+  auto array = pdf.get(entry.n, entry.generation);
+  if (array.type != pdf_object::ARRAY)
+    return pdf_error(array, ssprintf("invalid %s reference", what).c_str());
+  array.array.emplace_back(pdf_object::REFERENCE, n, 0);
+  pdf.update(entry.n, [&] { pdf_serialize(array, pdf.updates); });
+  return "";
+}
+
+/// Add a signature field to the given page, along with anything else it needs, and flush this
+/// as a separate incremental update, with a hexstring of `reservation' bytes left to be filled in.
+/// Its location, including the quotes, is stored in `sign_off' and `sign_len'.
+static std::string pdf_sign_update(pdf_updater& pdf, uint root_n, uint root_generation,
+    pdf_page_index& pages, size_t page_index, size_t reservation,
+    size_t& sign_off, size_t& sign_len) {
+  pdf_stats::timer timer(pdf_stats::UPDATE);
+  auto root = pdf.get(root_n, root_generation);
+  if (root.type != pdf_object::DICT)
+    return pdf_error(root, "invalid Root dictionary reference");
+
+  // 8.6.1 Interactive Form Dictionary
+  pdf_object acroform{pdf_object::DICT}, acroform_ref;
+  auto acroform_entry = root.dict.find("AcroForm");
+  if (acroform_entry != root.dict.end()) {
+    acroform = pdf_dereference(pdf, acroform_entry->second);
+    if (acroform.type != pdf_object::DICT)
+      return pdf_error(acroform, "invalid AcroForm");
+    if (acroform_entry->second.type == pdf_object::REFERENCE)
+      acroform_ref = acroform_entry->second;
+  }
+
+  // Fully qualified field names ought to be unique, so avoid those of other top-level fields
+  std::set<std::string> names;
+  for (const auto& field : pdf_object(pdf_dereference(pdf, acroform.dict["Fields"])).array) {
+    const auto& dict = pdf_dereference(pdf, field);
+    auto name = dict.dict.find("T");
+    if (name != dict.dict.end() && name->second.type == pdf_object::STRING)
+      names.insert(name->second.string);
+  }
+  uint field_number = 1;
+  while (names.count(ssprintf("Signature%u", field_number)))
+    field_number++;
+
+  // 8.7 Digital Signatures - /signature dictionary/
+  auto sigdict_n = pdf.allocate();
+  size_t byterange_off = 0, byterange_len = 0;
+  pdf.update(sigdict_n, [&] {
+    // The timestamp is important for Adobe Acrobat Reader DC, even with an RFC 3161 token.
+    pdf.updates.append("<< /Type/Sig /Filter/Adobe.PPKLite /SubFilter/adbe.pkcs7.detached\n"
+                       "   /M" + pdf_serialize(pdf_date(time(nullptr))) + " /ByteRange ");
+    byterange_off = pdf.length();
+    pdf.updates.append((byterange_len = sizeof "[0 18446744073709551615 "
+                        "18446744073709551615 18446744073709551615]" - 1), ' ');
+    pdf.updates.append("\n   /Contents <");
+    sign_off = pdf.length();
+    pdf.updates.append((sign_len = reservation * 2), '0');
+    pdf.updates.append("> >>");
+
+    // We actually need to exclude the hexstring quotes from signing
+    sign_off -= 1;
+    sign_len += 2;
+  });
+
+  // 8.6.3 Field Types - Signature Fields
+  pdf_object sigfield{pdf_object::DICT};
+  sigfield.dict.insert({"FT", {pdf_object::NAME, "Sig"}});
+  sigfield.dict.insert({"V", {pdf_object::REFERENCE, sigdict_n, 0}});
+  // 8.4.5 Annotations Types - Widget Annotations
+  // We can merge the Signature Annotation and omit Kids here
+  sigfield.dict.insert({"Subtype", {pdf_object::NAME, "Widget"}});
+  sigfield.dict.insert({"F", {pdf_object::NUMERIC, 2 /* Hidden */}});
+  sigfield.dict.insert({"T", {pdf_object::STRING, ssprintf("Signature%u", field_number)}});
+  sigfield.dict.insert({"Rect", {pdf_array{
+    {pdf_object::NUMERIC, 0},
+    {pdf_object::NUMERIC, 0},
+    {pdf_object::NUMERIC, 0},
+    {pdf_object::NUMERIC, 0},
+  }}});
+
+  auto sigfield_n = pdf.allocate();
+  pdf.update(sigfield_n, [&] { pdf_serialize(sigfield, pdf.updates); });
+
+  pdf_object page;
+  auto err = pages.get(page_index, page);
+  if (!err.empty())
+    return err;
+  auto& annots = page.dict["Annots"];
+  bool page_changed = annots.type != pdf_object::REFERENCE;
+  if (!(err = pdf_append_reference(pdf, annots, sigfield_n, "Annots")).empty())
+    return err;
+  if (page_changed)
+    pdf.update(page.n, [&] { pdf_serialize(page, pdf.updates); });
+
+  if (!(err = pdf_append_reference(pdf, acroform.dict["Fields"], sigfield_n, "Fields")).empty())
+    return err;
+
+  int sigflags = 0;
+  auto sigflags_entry = acroform.dict.find("SigFlags");
+  if (sigflags_entry != acroform.dict.end()) {
+    const auto& value = pdf_dereference(pdf, sigflags_entry->second);
+    if (value.is_integer() && value.number >= 0 && value.number <= INT_MAX)
+      sigflags = value.number;
+  }
+  acroform.dict["SigFlags"] =
+    {pdf_object::NUMERIC, double(sigflags | 3 /* SignaturesExist | AppendOnly */)};
+
+  bool root_changed = acroform_ref.type != pdf_object::REFERENCE;
+  if (root_changed)
+    root.dict["AcroForm"] = acroform;
+  else
+    pdf.update(acroform_ref.n, [&] { pdf_serialize(acroform, pdf.updates); });
+
+  // Upgrade the document version for SHA-256 etc.
+  if (pdf.version(root) < 16) {
+    root.dict["Version"] = {pdf_object::NAME, "1.6"};
+    root_changed = true;
+  }
+
+  if (root_changed)
+    pdf.update(root_n, [&] { pdf_serialize(root, pdf.updates); });
+  if (!(err = pdf.flush_updates()).empty())
+    return err;
+
+  // Now that we know the length of everything, store byte ranges of what we're about to sign,
+  // which must be everything but the resulting signature itself
+  size_t tail_off = sign_off + sign_len, tail_len = pdf.length() - tail_off;
+  auto ranges = ssprintf("[0 %zu %zu %zu]", sign_off, tail_off, tail_len);
+  if (ranges.length() > byterange_len)
+    return "not enough space reserved for /ByteRange";
+  pdf.updates.replace(byterange_off - pdf.document_length, ranges.length(), ranges);
+  return "";
+}
+
+/// Load the document, find its catalog, and the zero-based index of the page to sign
+static std::string pdf_sign_begin(pdf_updater& pdf, pdf_page_index& pages, long page,
+    uint& root_n, uint& root_generation, size_t& page_index) {
+  auto err = pdf.initialize();
+  if (!err.empty())
+    return err;
+
+  auto root_ref = pdf.trailer.find("Root");
+  if (root_ref == pdf.trailer.end() || root_ref->second.type != pdf_object::REFERENCE)
+    return "trailer does not contain a reference to Root";
+  root_n = root_ref->second.n, root_generation = root_ref->second.generation;
+  const auto& root = pdf.get(root_n, root_generation);
+  if (root.type != pdf_object::DICT)
+    return "invalid Root dictionary reference";
+
+  if (!(err = pages.initialize(root)).empty())
+    return err;
+
+  auto page_count = long(std::min(pages.count(), size_t(LONG_MAX)));
+  if (page > page_count || page < -page_count || !page)
+    return ssprintf("page %ld is out of range, the document has %ld pages", page, page_count);
+
+  page_index = page > 0 ? page - 1 : page_count + page;
+  return "";
+}
+
+/// The presumption here is that the document is valid.  The results with PDF 2.0 (2017)
+/// are currently unknown as the standard costs money.
+///
+/// Each signer gets its own signature field and incremental update, in order, so that every
+/// signature also covers all of the previous ones.  The document is only parsed and hashed once,
+/// the digest is to be one of the whole document, and it gets extended by all but the last update.
+///
+/// https://www.adobe.com/devnet-docs/acrobatetk/tools/DigSig/Acrobat_DigitalSignatures_in_PDF.pdf
+/// https://www.adobe.com/content/dam/acom/en/devnet/acrobat/pdfs/pdf_reference_1-7.pdf
+/// https://www.adobe.com/content/dam/acom/en/devnet/acrobat/pdfs/PPKAppearances.pdf
+static std::string pdf_sign(const char* document, size_t length, std::string& updates,
+    pdf_digest& digest, const std::vector<const pdf_signer*>& signers,
+    const pdf_sign_options& options) {
+  // All parsed objects are released at once when returning, this needs to be destroyed last
+  pdf_arena arena;
+  pdf_updater pdf(document, length, updates);
+  pdf_page_index pages(pdf);
+  uint root_n = 0, root_generation = 0;
+  size_t page_index = 0;
+  auto err = pdf_sign_begin(pdf, pages, options.page, root_n, root_generation, page_index);
+  if (!err.empty())
+    return err;
+
+  for (size_t i = 0; i < signers.size(); i++) {
+    // Take over the previous update, including its signature, for the digest of the next one
+    if (i && !digest.extend(pdf.updates.data() + (digest.length() - pdf.document_length),
+                            pdf.length() - digest.length()))
+      return openssl_error("OpenSSL failure");
+
+    size_t reservation = options.reservation, required = 0;
+    if (options.auto_reserve) {
+      reservation = signers[i]->estimate_signature_length();
+      if (options.tsa)
+        reservation += options.tsa->estimate_token_length();
+      pdf.save();
+    }
+    size_t sign_off = 0, sign_len = 0;
+    std::string md;
+    while (!(err = pdf_sign_update(pdf, root_n, root_generation, pages, page_index,
+                                   reservation, sign_off, sign_len)).empty() ||
+           !(err = pdf_digest_signed_ranges(pdf, digest, sign_off, sign_len, md)).empty() ||
+           !(err = pdf_fill_in_signature(pdf, *signers[i], md, sign_off, sign_len,
+                                         required, options.tsa)).empty()) {
+      if (!options.auto_reserve || !required)
+        return err;
+
+      // The digest of what precedes this update remains valid, so only redo the update itself.
+      // Signatures may vary in length slightly, e.g., with ECDSA.
+      pdf.restore();
+      reservation = required + 16;
+      required = 0;
+    }
+  }
+  return "";
+}
+
+/// Like pdf_sign(), but only prepare an incremental update with a signature field for a signature
+/// to be made elsewhere, leaving it with an empty hexstring of the requested reservation.
+/// Returns the DER-encoded signed attributes to be signed, and the location of the hexstring.
+static std::string pdf_prepare(const char* document, size_t length, std::string& updates,
+    pdf_digest& digest, const pdf_sign_options& options, std::string& attributes,
+    size_t& sign_off, size_t& sign_len) {
+  pdf_arena arena;
+  pdf_updater pdf(document, length, updates);
+  pdf_page_index pages(pdf);
+  uint root_n = 0, root_generation = 0;
+  size_t page_index = 0;
+  auto err = pdf_sign_begin(pdf, pages, options.page, root_n, root_generation, page_index);
+  if (!err.empty())
+    return err;
+
+  std::string md;
+  if (!(err = pdf_sign_update(pdf, root_n, root_generation, pages, page_index,
+                              options.reservation, sign_off, sign_len)).empty() ||
+      !(err = pdf_digest_signed_ranges(pdf, digest, sign_off, sign_len, md)).empty())
+    return err;
+  return pdf_signed_attributes(md, attributes);
+}
+
+// -------------------------------------------------------------------------------------------------
+
+/// Read-only view of an input file.  Regular files get memory-mapped, so that they never need to be
+/// copied onto the heap, anything else is read into a buffer.
+struct input_file {
+  int fd = -1;                ///< File descriptor, kept open for copying the contents out
+  struct stat st = {};        ///< File status at the time of opening
+  void* map = MAP_FAILED;     ///< Memory mapping of the file
+  std::string buffer;         ///< Fallback storage for unmappable files
+
+  const char* data = nullptr; ///< The contents of the file
+  size_t length = 0;          ///< Length of the contents
+
+  input_file() {}
+  input_file(const input_file&) = delete;
+  input_file& operator=(const input_file&) = delete;
+  ~input_file() {
+    if (map != MAP_FAILED) munmap(map, length);
+    if (fd != -1) close(fd);
+  }
+
+  /// Open and map or read in the file, returning an error message on failure
+  std::string open(const char* path);
+  /// Map or read in the file behind the already opened descriptor, which is to be named `path'
+  std::string load(const char* path);
+  /// Make a key for the contents within a pdf_digest_cache, return false if that isn't possible
+  bool identify(pdf_digest_cache::key& file) const {
+    return length == size_t(st.st_size) && pdf_digest_cache::identify(st, file);
+  }
+};
+
+std::string input_file::open(const char* path) {
+  if ((fd = ::open(path, O_RDONLY | O_CLOEXEC)) == -1)
+    return std::string(path) + ": " + strerror(errno);
+  return load(path);
+}
+
+std::string input_file::load(const char* path) {
+  pdf_stats::timer timer(pdf_stats::READ);
+  if (fstat(fd, &st))
+    return std::string(path) + ": " + strerror(errno);
+
+  // Documents are only ever accessed through the mapping, which the kernel pages in as needed,
+  // so mapping even huge ones is cheap, as long as they fit within the address space
+  if (S_ISREG(st.st_mode) && uint64_t(st.st_size) > SIZE_MAX)
+    return std::string(path) + ": " + strerror(EFBIG);
+  if (S_ISREG(st.st_mode) && st.st_size > 0 &&
+      (map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) != MAP_FAILED) {
+    data = static_cast<const char*>(map);
+    length = st.st_size;
+    (void) posix_madvise(map, length, POSIX_MADV_SEQUENTIAL);
+    return "";
+  }
+
+  char buf[1 << 16];
+  while (1) {
+    auto n = read(fd, buf, sizeof buf);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return std::string(path) + ": " + strerror(errno);
+    if (!n)
+      break;
+    buffer.append(buf, n);
+  }
+  data = buffer.data();
+  length = buffer.length();
+  return "";
+}
+
+static bool write_all(int fd, const char* data, size_t len, off_t offset) {
+  while (len) {
+    auto written = pwrite(fd, data, len, offset);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0)
+      return false;
+    data += written;
+    len -= written;
+    offset += written;
+  }
+  return true;
+}
+
+/// Copy the whole input file to the beginning of the output, within the kernel where possible
+static bool copy_input(int fd, const input_file& in) {
+  loff_t in_off = 0, out_off = 0;
+  while (in.map != MAP_FAILED && size_t(in_off) < in.length) {
+    auto copied = copy_file_range(in.fd, &in_off, fd, &out_off, in.length - in_off, 0);
+    if (copied < 0 && errno == EINTR)
+      continue;
+    if (copied < 0 && errno != EXDEV && errno != ENOSYS && errno != EINVAL &&
+        errno != EOPNOTSUPP && errno != EBADF)
+      return false;
+    if (copied <= 0)
+      break;
+  }
+  return write_all(fd, in.data + in_off, in.length - in_off, out_off);
+}
+
+/// Write the original document followed by its updates to the given path.  When the path refers
+/// to the input file itself, only the updates are appended to it, and synced to storage,
+/// so that the original document is never modified nor lost.  On success, the status
+/// of the resulting file may be retrieved.
+static std::string write_output(const char* path, const input_file& in, const std::string& updates,
+    struct stat* result = nullptr) {
+  pdf_stats::timer timer(pdf_stats::WRITE);
+  int fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0666);
+  struct stat st = {};
+  if (fd == -1 || fstat(fd, &st)) {
+    auto err = std::string(path) + ": " + strerror(errno);
+    if (fd != -1) close(fd);
+    return err;
+  }
+
+  bool in_place = in.map != MAP_FAILED && st.st_dev == in.st.st_dev && st.st_ino == in.st.st_ino;
+  if (in_place) {
+    // Concurrent signers of the same file must wait for each other, and the latter ones then fail,
+    // because their updates would refer to a document that no longer ends where they think it does
+    if (flock(fd, LOCK_EX) || fstat(fd, &st)) {
+      auto err = std::string(path) + ": " + strerror(errno);
+      close(fd);
+      return err;
+    }
+    // Rewrites may well keep the size, but they can't help changing the timestamps
+    if (st.st_size != off_t(in.length) ||
+        st.st_mtim.tv_sec != in.st.st_mtim.tv_sec || st.st_mtim.tv_nsec != in.st.st_mtim.tv_nsec ||
+        st.st_ctim.tv_sec != in.st.st_ctim.tv_sec || st.st_ctim.tv_nsec != in.st.st_ctim.tv_nsec) {
+      close(fd);
+      return std::string(path) + ": the file has changed while being signed";
+    }
+  }
+
+  bool ok = in_place || (!ftruncate(fd, 0) && copy_input(fd, in));
+  ok = ok && write_all(fd, updates.data(), updates.length(), in.length) &&
+    !ftruncate(fd, in.length + updates.length()) && (!in_place || !fsync(fd)) &&
+    (!result || !fstat(fd, result));
+
+  int saved_errno = errno;
+  if (!ok && in_place)
+    (void) ftruncate(fd, in.length);
+  if (close(fd) && ok)
+    ok = false, saved_errno = errno;
+  if (ok)
+    return "";
+
+  // Never remove the original document, only revert the changes made to it
+  if (!in_place)
+    (void) unlink(path);
+  return std::string(path) + ": " + strerror(saved_errno);
+}
+
+// -------------------------------------------------------------------------------------------------
+
+/// Tell URIs from file paths by their RFC 3986 scheme, which is at least two characters long
+static bool is_uri(const char* s) {
+  if (!isalpha(s[0]))
+    return false;
+  size_t i = 1;
+  while (isalnum(s[i]) || s[i] == '+' || s[i] == '-' || s[i] == '.')
+    i++;
+  return i > 1 && s[i] == ':';
+}
+
+__attribute__((format(printf, 2, 3)))
+static void die(int status, const char* format, ...) {
+  va_list ap;
+  va_start(ap, format);
+  if (isatty(fileno(stderr)))
+    vfprintf(stderr, ssprintf("\x1b[31m%s\x1b[0m\n", format).c_str(), ap);
+  else
+    vfprintf(stderr, format, ap);
+  va_end(ap);
+  exit(status);
+}
+
+/// Sign a single file, returning an exit status along with an error message on failure.
+/// Without an output path, only the updates get appended to the input file itself.
+static int sign_file(const std::vector<const pdf_signer*>& signers, pdf_digest_cache& cache,
+    const char* input_path, const char* output_path, const pdf_sign_options& options,
+    std::string& err) {
+  input_file input;
+  if (!(err = input.open(input_path)).empty())
+    return 1;
+  if (!output_path && (input.map == MAP_FAILED || !S_ISREG(input.st.st_mode))) {
+    err = std::string(input_path) + ": only regular files can be signed in place";
+    return 1;
+  }
+
+  // The original document is signed whole, so it can be hashed while the update is being built
+  pdf_digest_cache::key file;
+  bool known = input.identify(file);
+  pdf_digest digest(input.data, input.length, known ? &cache : nullptr, file);
+
+  std::string updates;
+  if (!(err = pdf_sign(input.data, input.length, updates, digest, signers, options)).empty()) {
+    err = "Error: " + err;
+    return 2;
+  }
+  struct stat st = {};
+  if (!(err = write_output(output_path ? output_path : input_path, input, updates, &st)).empty())
+    return 3;
+
+  // The result may well get signed again, and its digest is only one update away
+  if (pdf_digest_cache::identify(st, file) &&
+      digest.extend(updates.data() + (digest.length() - input.length),
+                    input.length + updates.length() - digest.length()))
+    digest.checkpoint(cache, file);
+  return 0;
+}
+
+/// Process all files in a manifest of NUL-separated paths, which come in pairs of input
+/// and output paths unless `pairs' is false, using a number of worker threads, reporting results
+/// for each of them on the standard output as they finish.  Without pairs, the job gets no output.
+/// Returns the most severe exit status encountered.
+static int run_batch(const char* manifest_path, bool pairs, long jobs, bool show_stats,
+    const std::function<int(const char* input, const char* output, std::string& err)>& job) {
+  input_file manifest;
+  auto err = manifest.open(strcmp(manifest_path, "-") ? manifest_path : "/dev/stdin");
+  if (!err.empty())
+    die(1, "%s", err.c_str());
+
+  std::vector<std::string> paths;
+  for (const char* p = manifest.data, * end = p + manifest.length; p < end; ) {
+    auto nul = static_cast<const char*>(memchr(p, 0, end - p));
+    paths.emplace_back(p, nul ? nul : end);
+    p = nul ? nul + 1 : end;
+  }
+  size_t step = pairs ? 2 : 1;
+  if (paths.size() % step)
+    die(1, "%s: %s", manifest_path, "the manifest must consist of input and output path pairs");
+
+  // Documents are independent of each other, and jobs only ever read anything shared
+  std::atomic<size_t> next(0);
+  std::mutex output_mutex;
+  int status = 0;
+  auto worker = [&] {
+    std::string err;
+    for (size_t i; (i = next.fetch_add(step)) < paths.size(); ) {
+      pdf_stats stats(show_stats);
+      auto result = job(paths[i].c_str(), pairs ? paths[i + 1].c_str() : nullptr, err);
+
+      std::lock_guard<std::mutex> lock(output_mutex);
+      printf("%s: %s\n", paths[i].c_str(), result ? err.c_str() : "OK");
+      fflush(stdout);
+      if (show_stats)
+        fprintf(stderr, "{\"input\": %s, %s\"status\": %d, %s}\n",
+                json_string(paths[i]).c_str(),
+                pairs ? ("\"output\": " + json_string(paths[i + 1]) + ", ").c_str() : "",
+                result, stats.json().c_str());
+      status = std::max(status, result);
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (long i = 1; i < jobs; i++)
+    workers.emplace_back(worker);
+  worker();
+  for (auto& thread : workers)
+    thread.join();
+  return status;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+/// A signer that only hands out a signature made elsewhere, after checking it against the data
+struct pdf_external_signer : pdf_signer {
+  std::string signature;  ///< The signature to hand out
+
+  /// Load the signer's certificate and any intermediate certificates from a PEM file,
+  /// along with a raw signature, returning an error message on failure
+  std::string load(const char* certificates_path, const char* signature_path);
+
+  std::string sign(const unsigned char* data, size_t length,
+                   std::string& signature) const override;
+};
+
+std::string pdf_external_signer::load(const char* certificates_path, const char* signature_path) {
+  input_file in;
+  auto err = in.open(signature_path);
+  if (!err.empty())
+    return err;
+  signature.assign(in.data, in.length);
+
+  auto fp = fopen(certificates_path, "r");
+  if (!fp)
+    return std::string(certificates_path) + ": " + strerror(errno);
+
+  ERR_clear_error();
+  if (!(chain = sk_X509_new_null()))
+    err = "OpenSSL failure";
+  while (err.empty()) {
+    auto cert = PEM_read_X509(fp, nullptr, nullptr, nullptr);
+    if (!cert)
+      break;
+    if (!certificate)
+      certificate = cert;
+    else if (!sk_X509_push(chain, cert))
+      X509_free(cert), err = "OpenSSL failure";
   }
+  fclose(fp);
 
-  trailer["Size"] = {pdf_object::NUMERIC, double(xref_size)};
-  document +=
-    "trailer\n" + pdf_serialize(trailer) + ssprintf("\nstartxref\n%zu\n%%%%EOF\n", startxref);
+  // Reaching the end of the file is reported as an error, too
+  if (err.empty() && !certificate)
+    err = std::string(certificates_path) + ": must contain the signer's certificate first";
+  else if (err.empty())
+    ERR_clear_error(), err = check();
+  return openssl_error(err);
 }
 
-// -------------------------------------------------------------------------------------------------
+std::string pdf_external_signer::sign(const unsigned char* data, size_t length,
+    std::string& signature) const {
+  EVP_MD_CTX* ctx = nullptr;
+  std::string err = "the signature doesn't match the prepared document and the certificate";
+  if ((ctx = EVP_MD_CTX_new()) &&
+      EVP_DigestVerifyInit(ctx, nullptr, EVP_sha256(), nullptr,
+                           X509_get0_pubkey(certificate)) == 1 &&
+      EVP_DigestVerify(ctx, reinterpret_cast<const unsigned char*>(this->signature.data()),
+                       this->signature.length(), data, length) == 1) {
+    signature = this->signature;
+    err.clear();
+  }
+  EVP_MD_CTX_free(ctx);
+  return err;
+}
 
-/// Make a PDF object representing the given point in time
-static pdf_object pdf_date(time_t timestamp) {
-  struct tm parts;
-  assert(localtime_r(&timestamp, &parts));
+/// What needs to be remembered between preparing a document and completing its signature
+struct pdf_prepared_state {
+  uint64_t length = 0;     ///< Length of the prepared document
+  uint64_t sign_off = 0;   ///< Offset of the hexstring for the signature, including quotes
+  uint64_t sign_len = 0;   ///< Length of the hexstring, including quotes
+  std::string attributes;  ///< DER-encoded signed attributes
 
-  char buf[64];
-  assert(strftime(buf, sizeof buf, "D:%Y%m%d%H%M%S", &parts));
+  static constexpr const char* magic = "pdf-simple-sign prepared state 1";
 
-  std::string offset = "Z";
-  auto offset_min = parts.tm_gmtoff / 60;
-  if (parts.tm_gmtoff < 0)
-    offset = ssprintf("-%02ld'%02ld'", -offset_min / 60, -offset_min % 60);
-  if (parts.tm_gmtoff > 0)
-    offset = ssprintf("+%02ld'%02ld'", +offset_min / 60, +offset_min % 60);
-  return {pdf_object::STRING, buf + offset};
-}
+  /// Store the state in a file, returning an error message on failure
+  std::string save(const char* path) const;
+  /// Load the state from a file, returning an error message on failure
+  std::string load(const char* path);
+};
 
-static pdf_object pdf_get_first_page(pdf_updater& pdf, uint node_n, uint node_generation) {
-  auto obj = pdf.get(node_n, node_generation);
-  if (obj.type != pdf_object::DICT)
-    return {pdf_object::NIL};
+std::string pdf_prepared_state::save(const char* path) const {
+  auto out = ssprintf("%s\n%llu %llu %llu\n", magic, (unsigned long long) length,
+                      (unsigned long long) sign_off, (unsigned long long) sign_len);
+  out += pdf_hex(attributes) + "\n";
 
-  // Out of convenience; these aren't filled normally
-  obj.n = node_n;
-  obj.generation = node_generation;
+  auto fp = fopen(path, "w");
+  if (!fp)
+    return std::string(path) + ": " + strerror(errno);
+  bool ok = fwrite(out.data(), 1, out.length(), fp) == out.length();
+  if (fclose(fp))
+    ok = false;
+  return ok ? "" : std::string(path) + ": " + strerror(errno);
+}
 
-  auto type = obj.dict.find("Type");
-  if (type == obj.dict.end() || type->second.type != pdf_object::NAME)
-    return {pdf_object::NIL};
-  if (type->second.string == "Page")
-    return obj;
-  if (type->second.string != "Pages")
-    return {pdf_object::NIL};
+std::string pdf_prepared_state::load(const char* path) {
+  input_file in;
+  auto err = in.open(path);
+  if (!err.empty())
+    return err;
 
-  // XXX technically speaking, this may be an indirect reference.  The correct way to solve this
-  //   seems to be having "pdf_updater" include a wrapper around "obj.dict.find"
-  auto kids = obj.dict.find("Kids");
-  if (kids == obj.dict.end() || kids->second.type != pdf_object::ARRAY ||
-      kids->second.array.empty() ||
-      kids->second.array.at(0).type != pdf_object::REFERENCE)
-    return {pdf_object::NIL};
+  std::string text(in.data, in.length), hex;
+  unsigned long long values[3] = {};
+  auto header = std::string(magic) + "\n%llu %llu %llu\n";
+  int consumed = 0;
+  if (sscanf(text.c_str(), (header + "%n").c_str(), &values[0], &values[1], &values[2],
+             &consumed) != 3 || !consumed)
+    return std::string(path) + ": not a prepared state file";
 
-  // XXX nothing prevents us from recursing in an evil circular graph
-  return pdf_get_first_page(pdf, kids->second.array.at(0).n, kids->second.array.at(0).generation);
+  length = values[0], sign_off = values[1], sign_len = values[2];
+  attributes.clear();
+  for (size_t i = consumed; i + 1 < text.length() && isxdigit(text[i]); i += 2) {
+    if (!isxdigit(text[i + 1]))
+      break;
+    attributes += char(std::stoi(text.substr(i, 2), nullptr, 16));
+  }
+  if (attributes.empty() || sign_len < 2 || sign_off + sign_len > length)
+    return std::string(path) + ": invalid prepared state";
+  return "";
 }
 
-// -------------------------------------------------------------------------------------------------
+/// Prepare a file for an external signature, storing the state of it in another file, and print
+/// the SHA-256 digest of what is to be signed.  Returns an exit status along with an error message
+/// on failure.
+static int prepare_file(const char* input_path, const char* output_path, const char* state_path,
+    const pdf_sign_options& options, std::string& err) {
+  input_file input;
+  if (!(err = input.open(input_path)).empty())
+    return 1;
 
-static std::string pkcs12_path, pkcs12_pass;
+  pdf_digest digest(input.data, input.length);
+  pdf_prepared_state state;
+  size_t sign_off = 0, sign_len = 0;
+  std::string updates;
+  if (!(err = pdf_prepare(input.data, input.length, updates, digest, options, state.attributes,
+                          sign_off, sign_len)).empty()) {
+    err = "Error: " + err;
+    return 2;
+  }
+  if (!(err = write_output(output_path, input, updates)).empty())
+    return 3;
 
-// /All/ bytes are checked, except for the signature hexstring itself
-static std::string pdf_fill_in_signature(std::string& document, size_t sign_off, size_t sign_len) {
-  size_t tail_off = sign_off + sign_len, tail_len = document.size() - tail_off;
-  if (pkcs12_path.empty())
-    return "undefined path to the signing key";
+  state.length = input.length + updates.length();
+  state.sign_off = sign_off;
+  state.sign_len = sign_len;
+  if (!(err = state.save(state_path)).empty())
+    return 3;
 
-  auto pkcs12_fp = fopen(pkcs12_path.c_str(), "r");
-  if (!pkcs12_fp)
-    return pkcs12_path + ": " + strerror(errno);
+  unsigned char md[EVP_MAX_MD_SIZE] = {};
+  unsigned int md_len = 0;
+  if (!EVP_Digest(state.attributes.data(), state.attributes.length(), md, &md_len, EVP_sha256(),
+                  nullptr)) {
+    err = "Error: " + openssl_error("OpenSSL failure");
+    return 2;
+  }
+  printf("%s\n", pdf_hex(std::string(reinterpret_cast<const char*>(md), md_len)).c_str());
+  return 0;
+}
 
-  // Abandon hope, all ye who enter OpenSSL!  Half of it is undocumented.
-  OpenSSL_add_all_algorithms();
-  ERR_load_crypto_strings();
-  ERR_clear_error();
+/// Write an externally made signature into a file prepared by prepare_file(), without reading
+/// anything but its placeholder back.  Returns an exit status along with an error message
+/// on failure.
+static int complete_file(const char* state_path, const char* output_path,
+    const char* signature_path, const char* certificates_path, pdf_tsa* tsa, std::string& err) {
+  pdf_prepared_state state;
+  pdf_external_signer signer;
+  if (!(err = state.load(state_path)).empty() ||
+      !(err = signer.load(certificates_path, signature_path)).empty())
+    return 1;
 
-  PKCS12* p12 = nullptr;
-  EVP_PKEY* private_key = nullptr;
-  X509* certificate = nullptr;
-  STACK_OF(X509)* chain = nullptr;
-  PKCS7* p7 = nullptr;
-  int len = 0, sign_flags = PKCS7_DETACHED | PKCS7_BINARY | PKCS7_NOSMIMECAP | PKCS7_PARTIAL;
-  BIO* p7bio = nullptr;
-  unsigned char* buf = nullptr;
+  std::string signature, hex;
+  size_t required = 0;
+  if (!(err = pdf_build_signature(signer, state.attributes, tsa, signature)).empty() ||
+      !(err = pdf_encode_signature(signature, state.sign_len, required, hex)).empty()) {
+    err = "Error: " + err;
+    return 2;
+  }
 
-  // OpenSSL error reasons will usually be of more value than any distinction I can come up with
-  std::string err = "OpenSSL failure";
+  pdf_stats::timer timer(pdf_stats::WRITE);
+  int fd = open(output_path, O_RDWR | O_CLOEXEC);
+  struct stat st = {};
+  if (fd == -1 || fstat(fd, &st)) {
+    err = std::string(output_path) + ": " + strerror(errno);
+    if (fd != -1) close(fd);
+    return 3;
+  }
 
-  if (!(p12 = d2i_PKCS12_fp(pkcs12_fp, nullptr)) ||
-      !PKCS12_parse(p12, pkcs12_pass.c_str(), &private_key, &certificate, &chain)) {
-    err = pkcs12_path + ": parse failure";
-    goto error;
+  // Make sure that the document hasn't changed in the meantime, or been signed already
+  std::string placeholder(state.sign_len, 0);
+  if (uint64_t(st.st_size) != state.length ||
+      pread(fd, &placeholder[0], state.sign_len, state.sign_off) != ssize_t(state.sign_len) ||
+      placeholder != "<" + std::string(state.sign_len - 2, '0') + ">") {
+    err = std::string(output_path) + ": doesn't match the prepared state";
+    close(fd);
+    return 3;
   }
-  if (!private_key || !certificate) {
-    err = pkcs12_path + ": must contain a private key and a valid certificate chain";
-    goto error;
+  if (!write_all(fd, hex.data(), hex.length(), state.sign_off + 1) || close(fd)) {
+    err = std::string(output_path) + ": " + strerror(errno);
+    return 3;
   }
-  // Prevent useless signatures -- makes pdfsig from poppler happy at least (and NSS by extension)
-  if (!(X509_get_key_usage(certificate) & (KU_DIGITAL_SIGNATURE | KU_NON_REPUDIATION))) {
-    err = "the certificate's key usage must include digital signatures or non-repudiation";
-    goto error;
+  return 0;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+/// A signature found within a document, and what it takes to check it
+struct pdf_signature {
+  std::string name;            ///< Fully qualified name of the signature field
+  uint64_t ranges[4] = {};     ///< The /ByteRange, covering everything but the signature itself
+  std::string contents;        ///< The DER-encoded PKCS#7 SignedData, possibly with padding
+  PKCS7* p7 = nullptr;         ///< The decoded signature
+  const EVP_MD* md = nullptr;  ///< The digest algorithm used by the signer
+  std::string digest;          ///< The digest of the signed ranges
+  std::string signer;          ///< Subject of the signer's certificate, once verified
+
+  /// Return the length of the revision that the signature covers,
+  /// which only the last signature may extend to the end of the document
+  uint64_t covered() const { return ranges[2] + ranges[3]; }
+
+  pdf_signature() {}
+  pdf_signature(const pdf_signature&) = delete;
+  pdf_signature& operator=(const pdf_signature&) = delete;
+  ~pdf_signature() { PKCS7_free(p7); }
+};
+
+/// Collect signature fields from a field tree, inheriting the field type.  The depth is limited,
+/// which also protects against reference loops.
+static std::string pdf_find_signatures(const pdf_updater& pdf, const pdf_object& fields,
+    const std::string& prefix, const std::string& inherited_type,
+    std::list<pdf_signature>& signatures, int depth = 0) {
+  if (depth > 32)
+    return "the field tree is too deep";
+
+  for (const auto& field_ref : pdf_object(pdf_dereference(pdf, fields)).array) {
+    pdf_object field = pdf_dereference(pdf, field_ref);
+    if (field.type != pdf_object::DICT)
+      return pdf_error(field, "invalid field");
+
+    auto name = prefix, type = inherited_type;
+    auto partial = field.dict.find("T");
+    if (partial != field.dict.end() && partial->second.type == pdf_object::STRING)
+      name += (name.empty() ? "" : ".") + partial->second.string;
+    auto ft = field.dict.find("FT");
+    if (ft != field.dict.end() && ft->second.type == pdf_object::NAME)
+      type = ft->second.string;
+
+    auto kids = field.dict.find("Kids");
+    if (kids != field.dict.end()) {
+      auto err = pdf_find_signatures(pdf, kids->second, name, type, signatures, depth + 1);
+      if (!err.empty())
+        return err;
+    }
+
+    // Unsigned signature fields are of no interest
+    auto value = field.dict.find("V");
+    if (type != "Sig" || value == field.dict.end())
+      continue;
+    const auto& sigdict = pdf_dereference(pdf, value->second);
+    if (sigdict.type == pdf_object::NIL)
+      continue;
+    if (sigdict.type != pdf_object::DICT)
+      return name + ": " + pdf_error(sigdict, "invalid signature dictionary");
+
+    // adbe.pkcs7.sha1 signs a digest embedded in the signature, and isn't worth supporting
+    auto subfilter = sigdict.dict.find("SubFilter");
+    if (subfilter == sigdict.dict.end() || subfilter->second.type != pdf_object::NAME ||
+        (subfilter->second.string != "adbe.pkcs7.detached" &&
+         subfilter->second.string != "ETSI.CAdES.detached"))
+      return name + ": unsupported signature SubFilter";
+
+    signatures.emplace_back();
+    auto& signature = signatures.back();
+    signature.name = name;
+
+    auto byterange = sigdict.dict.find("ByteRange");
+    auto contents = sigdict.dict.find("Contents");
+    if (byterange == sigdict.dict.end() || byterange->second.type != pdf_object::ARRAY ||
+        byterange->second.array.size() != 4)
+      return name + ": invalid ByteRange";
+    for (size_t i = 0; i < 4; i++)
+      if (!byterange->second.array[i].get_unsigned(signature.ranges[i]))
+        return name + ": invalid ByteRange";
+    if (contents == sigdict.dict.end() || contents->second.type != pdf_object::STRING)
+      return name + ": invalid signature Contents";
+    signature.contents = contents->second.string;
   }
-  if (!(X509_get_extended_key_usage(certificate) & (XKU_SMIME | XKU_ANYEKU))) {
-    err = "the certificate's extended key usage must include S/MIME";
-    goto error;
+  return "";
+}
+
+/// Check that the signature's ranges cover everything from the beginning of the document
+/// up to the end of some revision, except for precisely its own hexstring, and decode it
+static std::string pdf_check_coverage(const pdf_updater& pdf, pdf_signature& signature) {
+  const auto r = signature.ranges;
+  if (r[0] != 0 || r[1] == 0 || r[2] <= r[1] || r[3] > pdf.document_length ||
+      r[2] > pdf.document_length - r[3])
+    return signature.name + ": the ByteRange doesn't cover the document";
+
+  pdf_lexer lex(pdf.document + r[1], pdf.document + r[2]);
+  auto gap = lex.next();
+  if (pdf.document[r[1]] != '<' || gap.type != pdf_object::STRING ||
+      gap.string != signature.contents || lex.p != lex.end)
+    return signature.name + ": the ByteRange leaves out more than the signature";
+
+  auto p = reinterpret_cast<const unsigned char*>(signature.contents.data());
+  if (!(signature.p7 = d2i_PKCS7(nullptr, &p, signature.contents.length())) ||
+      !PKCS7_type_is_signed(signature.p7) ||
+      sk_PKCS7_SIGNER_INFO_num(PKCS7_get_signer_info(signature.p7)) != 1) {
+    ERR_clear_error();
+    return signature.name + ": the signature isn't a PKCS#7 SignedData with one signer";
   }
-#if 0  // This happily ignores XKU_ANYEKU and I want my tiny world to make a tiny bit more sense
-  if (X509_check_purpose(certificate, X509_PURPOSE_SMIME_SIGN, false /* not a CA certificate */)) {
-    err = "the certificate can't be used for S/MIME digital signatures";
-    goto error;
+
+  X509_ALGOR* digest_algorithm = nullptr;
+  auto si = sk_PKCS7_SIGNER_INFO_value(PKCS7_get_signer_info(signature.p7), 0);
+  PKCS7_SIGNER_INFO_get0_algs(si, nullptr, &digest_algorithm, nullptr);
+  if (!(signature.md = EVP_get_digestbyobj(digest_algorithm->algorithm)))
+    return signature.name + ": unsupported digest algorithm";
+  return "";
+}
+
+/// Hash the signed ranges of all signatures in a single pass through the document.
+/// As all of them start at its beginning, signatures are taken in the order of their hexstrings,
+/// each continuing from where the previous one with the same digest algorithm has stopped.
+static std::string pdf_digest_signatures(const pdf_updater& pdf,
+    std::list<pdf_signature>& signatures) {
+  pdf_stats::timer timer(pdf_stats::HASH);
+  std::vector<pdf_signature*> order;
+  for (auto& signature : signatures)
+    order.push_back(&signature);
+  std::sort(order.begin(), order.end(), [](const pdf_signature* a, const pdf_signature* b) {
+    return a->ranges[1] < b->ranges[1];
+  });
+
+  // There will usually be just this one, for SHA-256
+  std::map<const EVP_MD*, std::pair<EVP_MD_CTX*, uint64_t>> prefixes;
+  EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+  std::string err;
+  for (auto signature : order) {
+    auto& prefix = prefixes[signature->md];
+    if (!prefix.first && (!(prefix.first = EVP_MD_CTX_new()) ||
+                          !EVP_DigestInit_ex(prefix.first, signature->md, nullptr))) {
+      err = "OpenSSL failure";
+      break;
+    }
+
+    unsigned char buf[EVP_MAX_MD_SIZE] = {};
+    unsigned int len = 0;
+    const auto r = signature->ranges;
+    pdf_stats::count(pdf_stats::BYTES_HASHED, r[1] - prefix.second + r[3]);
+    if (!ctx || !EVP_DigestUpdate(prefix.first, pdf.document + prefix.second, r[1] - prefix.second) ||
+        !EVP_MD_CTX_copy_ex(ctx, prefix.first) ||
+        !EVP_DigestUpdate(ctx, pdf.document + r[2], r[3]) || !EVP_DigestFinal_ex(ctx, buf, &len)) {
+      err = "OpenSSL failure";
+      break;
+    }
+    prefix.second = r[1];
+    signature->digest.assign(reinterpret_cast<const char*>(buf), len);
   }
-#endif
 
-  // The default digest is SHA1, which is mildly insecure now -- hence using PKCS7_sign_add_signer
-  if (!(p7 = PKCS7_sign(nullptr, nullptr, nullptr, nullptr, sign_flags)) ||
-      !PKCS7_sign_add_signer(p7, certificate, private_key, EVP_sha256(), sign_flags))
-    goto error;
-  // For RFC 3161, this is roughly how a timestamp token would be attached (see Appendix A):
-  //   PKCS7_add_attribute(signer_info, NID_id_smime_aa_timeStampToken, V_ASN1_SEQUENCE, value)
-  for (int i = 0; i < sk_X509_num(chain); i++)
-    if (!PKCS7_add_certificate(p7, sk_X509_value(chain, i)))
-      goto error;
+  EVP_MD_CTX_free(ctx);
+  for (auto& prefix : prefixes)
+    EVP_MD_CTX_free(prefix.second.first);
+  return openssl_error(err);
+}
+
+/// Check the signature against the digest of its ranges, and the signer's certificate
+/// against trusted ones, as of now, not considering any timestamps
+static std::string pdf_verify_signature(X509_STORE* store, pdf_signature& signature) {
+  pdf_stats::timer timer(pdf_stats::VERIFY);
+  auto si = sk_PKCS7_SIGNER_INFO_value(PKCS7_get_signer_info(signature.p7), 0);
+  auto attributes = PKCS7_get_signed_attributes(si);
+  auto md = PKCS7_digest_from_attributes(attributes);
+  if (!md)
+    return signature.name + ": the signature has no signed message digest";
+  if (size_t(ASN1_STRING_length(md)) != signature.digest.length() ||
+      memcmp(ASN1_STRING_get0_data(md), signature.digest.data(), signature.digest.length()))
+    return signature.name + ": the document has been modified since it was signed";
+
+  STACK_OF(X509)* signers = nullptr;
+  X509* certificate = nullptr;
+  unsigned char* der = nullptr;
+  int der_len = 0;
+  EVP_MD_CTX* md_ctx = nullptr;
+  X509_STORE_CTX* store_ctx = nullptr;
 
-  // Adaptation of the innards of the undocumented PKCS7_final() -- I didn't feel like making
-  // a copy of the whole document.  Hopefully this writes directly into a digest BIO.
-  if (!(p7bio = PKCS7_dataInit(p7, nullptr)) ||
-      (ssize_t) sign_off != BIO_write(p7bio, document.data(), sign_off) ||
-      (ssize_t) tail_len != BIO_write(p7bio, document.data() + tail_off, tail_len) ||
-      BIO_flush(p7bio) != 1 || !PKCS7_dataFinal(p7, p7bio))
+  // 5.4 Message Digest Calculation Process: the signature is of the DER-encoded SET OF
+  ERR_clear_error();
+  std::string err = signature.name + ": the signer's certificate is missing";
+  if (!(signers = PKCS7_get0_signers(signature.p7, nullptr, 0)) ||
+      !(certificate = sk_X509_value(signers, 0)))
     goto error;
 
-#if 0
-  {
-    // Debugging: openssl cms -inform PEM -in pdf_signature.pem -noout -cmsout -print
-    // Context: https://stackoverflow.com/a/29253469
-    auto fp = fopen("pdf_signature.pem", "wb");
-    assert(PEM_write_PKCS7(fp, p7) && !fclose(fp));
-  }
-#endif
+  err = signature.name + ": the signature doesn't match the signer's certificate";
+  if ((der_len = ASN1_item_i2d(reinterpret_cast<ASN1_VALUE*>(attributes), &der,
+                               ASN1_ITEM_rptr(PKCS7_ATTR_VERIFY))) <= 0 ||
+      !(md_ctx = EVP_MD_CTX_new()) ||
+      EVP_DigestVerifyInit(md_ctx, nullptr, signature.md, nullptr,
+                           X509_get0_pubkey(certificate)) != 1 ||
+      EVP_DigestVerify(md_ctx, ASN1_STRING_get0_data(si->enc_digest),
+                       ASN1_STRING_length(si->enc_digest), der, der_len) != 1)
+    goto error;
 
-  if ((len = i2d_PKCS7(p7, &buf)) < 0)
+  err = "OpenSSL failure";
+  if (!(store_ctx = X509_STORE_CTX_new()) ||
+      !X509_STORE_CTX_init(store_ctx, store, certificate, signature.p7->d.sign->cert))
     goto error;
-  if (size_t(len) * 2 > sign_len - 2 /* hexstring quotes */) {
-    // The obvious solution is to increase the allocation... or spend a week reading specifications
-    // while losing all faith in humanity as a species, and skip the PKCS7 API entirely
-    err = ssprintf("not enough space reserved for the signature (%zu nibbles vs %zu nibbles)",
-                   sign_len - 2, size_t(len) * 2);
+  if (X509_verify_cert(store_ctx) != 1) {
+    err = signature.name + ": " +
+      X509_verify_cert_error_string(X509_STORE_CTX_get_error(store_ctx));
     goto error;
   }
-  for (int i = 0; i < len; i++) {
-    document[sign_off + 2 * i + 1] = "0123456789abcdef"[buf[i] / 16];
-    document[sign_off + 2 * i + 2] = "0123456789abcdef"[buf[i] % 16];
+
+  if (auto subject = X509_NAME_oneline(X509_get_subject_name(certificate), nullptr, 0)) {
+    signature.signer = subject;
+    OPENSSL_free(subject);
   }
   err.clear();
 
 error:
-  OPENSSL_free(buf);
-  BIO_free_all(p7bio);
-  PKCS7_free(p7);
-  sk_X509_pop_free(chain, X509_free);
-  X509_free(certificate);
-  EVP_PKEY_free(private_key);
-  PKCS12_free(p12);
-
-  // In any case, clear the error stack (it's a queue, really) to avoid confusion elsewhere
-  while (auto code = ERR_get_error())
-    if (auto reason = ERR_reason_error_string(code))
-      err = err + "; " + reason;
-
-  fclose(pkcs12_fp);
-  return err;
+  X509_STORE_CTX_free(store_ctx);
+  EVP_MD_CTX_free(md_ctx);
+  OPENSSL_free(der);
+  sk_X509_free(signers);
+  return openssl_error(err);
 }
 
-// -------------------------------------------------------------------------------------------------
-
-/// The presumption here is that the document is valid and that it doesn't employ cross-reference
-/// streams from PDF 1.5, or at least constitutes a hybrid-reference file.  The results with
-/// PDF 2.0 (2017) are currently unknown as the standard costs money.
-///
-/// https://www.adobe.com/devnet-docs/acrobatetk/tools/DigSig/Acrobat_DigitalSignatures_in_PDF.pdf
-/// https://www.adobe.com/content/dam/acom/en/devnet/acrobat/pdfs/pdf_reference_1-7.pdf
-/// https://www.adobe.com/content/dam/acom/en/devnet/acrobat/pdfs/PPKAppearances.pdf
-static std::string pdf_sign(std::string& document, ushort reservation) {
-  pdf_updater pdf(document);
+/// Find all signatures of a document through its AcroForm, and verify them,
+/// returning an error message for the first one to fail, if there are none,
+/// or if none of them covers the whole document
+static std::string pdf_verify(const char* document, size_t length, X509_STORE* store,
+    std::list<pdf_signature>& signatures) {
+  std::string updates;
+  pdf_updater pdf(document, length, updates);
   auto err = pdf.initialize();
   if (!err.empty())
     return err;
@@ -836,136 +3888,368 @@ static std::string pdf_sign(std::string& document, ushort reservation) {
   auto root_ref = pdf.trailer.find("Root");
   if (root_ref == pdf.trailer.end() || root_ref->second.type != pdf_object::REFERENCE)
     return "trailer does not contain a reference to Root";
-  auto root = pdf.get(root_ref->second.n, root_ref->second.generation);
+  pdf_object root = pdf.get(root_ref->second.n, root_ref->second.generation);
   if (root.type != pdf_object::DICT)
-    return "invalid Root dictionary reference";
+    return pdf_error(root, "invalid Root dictionary reference");
 
-  // 8.7 Digital Signatures - /signature dictionary/
-  auto sigdict_n = pdf.allocate();
-  size_t byterange_off = 0, byterange_len = 0, sign_off = 0, sign_len = 0;
-  pdf.update(sigdict_n, [&] {
-    // The timestamp is important for Adobe Acrobat Reader DC.  The ideal would be to use RFC 3161.
-    pdf.document.append("<< /Type/Sig /Filter/Adobe.PPKLite /SubFilter/adbe.pkcs7.detached\n"
-                        "   /M" + pdf_serialize(pdf_date(time(nullptr))) + " /ByteRange ");
-    byterange_off = pdf.document.size();
-    pdf.document.append((byterange_len = 32 /* fine for a gigabyte */), ' ');
-    pdf.document.append("\n   /Contents <");
-    sign_off = pdf.document.size();
-    pdf.document.append((sign_len = reservation * 2), '0');
-    pdf.document.append("> >>");
+  auto acroform_entry = root.dict.find("AcroForm");
+  if (acroform_entry == root.dict.end())
+    return "the document has no signatures";
+  pdf_object acroform = pdf_dereference(pdf, acroform_entry->second);
+  if (acroform.type != pdf_object::DICT)
+    return pdf_error(acroform, "invalid AcroForm");
+  if (!(err = pdf_find_signatures(pdf, acroform.dict["Fields"], "", "", signatures)).empty())
+    return err;
+  if (signatures.empty())
+    return "the document has no signatures";
 
-    // We actually need to exclude the hexstring quotes from signing
-    sign_off -= 1;
-    sign_len += 2;
-  });
+  for (auto& signature : signatures)
+    if (!(err = pdf_check_coverage(pdf, signature)).empty())
+      return err;
+  if (!(err = pdf_digest_signatures(pdf, signatures)).empty())
+    return err;
+  bool whole = false;
+  for (auto& signature : signatures) {
+    if (!(err = pdf_verify_signature(store, signature)).empty())
+      return err;
+    whole |= signature.covered() == length;
+  }
+  return whole ? "" : "the document has been updated since it was last signed";
+}
 
-  // 8.6.3 Field Types - Signature Fields
-  pdf_object sigfield{pdf_object::DICT};
-  sigfield.dict.insert({"FT", {pdf_object::NAME, "Sig"}});
-  sigfield.dict.insert({"V", {pdf_object::REFERENCE, sigdict_n, 0}});
-  // 8.4.5 Annotations Types - Widget Annotations
-  // We can merge the Signature Annotation and omit Kids here
-  sigfield.dict.insert({"Subtype", {pdf_object::NAME, "Widget"}});
-  sigfield.dict.insert({"F", {pdf_object::NUMERIC, 2 /* Hidden */}});
-  sigfield.dict.insert({"T", {pdf_object::STRING, "Signature1"}});
-  sigfield.dict.insert({"Rect", {std::vector<pdf_object>{
-    {pdf_object::NUMERIC, 0},
-    {pdf_object::NUMERIC, 0},
-    {pdf_object::NUMERIC, 0},
-    {pdf_object::NUMERIC, 0},
-  }}});
+/// Verify all signatures of a single file, returning an exit status along with an error message
+/// on failure.  With a report, a line describing each verified signature is appended to it.
+static int verify_file(X509_STORE* store, const char* path, std::string& err,
+    std::string* report = nullptr) {
+  input_file input;
+  if (!(err = input.open(path)).empty())
+    return 1;
 
-  auto sigfield_n = pdf.allocate();
-  pdf.update(sigfield_n, [&] { pdf.document += pdf_serialize(sigfield); });
+  std::list<pdf_signature> signatures;
+  if (!(err = pdf_verify(input.data, input.length, store, signatures)).empty()) {
+    err = "Error: " + err;
+    return 2;
+  }
+  for (const auto& signature : signatures) {
+    if (!report)
+      break;
+    *report += signature.name + ": signed by " + signature.signer;
+    if (signature.covered() == input.length)
+      *report += ", covers the whole document\n";
+    else
+      *report += ssprintf(", covers %llu of %zu bytes\n",
+                          (unsigned long long) signature.covered(), input.length);
+  }
+  return 0;
+}
 
-  auto pages_ref = root.dict.find("Pages");
-  if (pages_ref == root.dict.end() || pages_ref->second.type != pdf_object::REFERENCE)
-    return "invalid Pages reference";
-  auto page = pdf_get_first_page(pdf, pages_ref->second.n, pages_ref->second.generation);
-  if (page.type != pdf_object::DICT)
-    return "invalid or unsupported page tree";
+/// Load trusted certificates from a PEM file, returning an error message on failure
+static std::string load_trusted(const char* path, X509_STORE*& store) {
+  ERR_clear_error();
+  std::string err = std::string(path) + ": cannot load trusted certificates";
+  X509_LOOKUP* lookup = nullptr;
+  if ((store = X509_STORE_new()) && (lookup = X509_STORE_add_lookup(store, X509_LOOKUP_file())) &&
+      X509_LOOKUP_load_file(lookup, path, X509_FILETYPE_PEM) > 0)
+    err.clear();
+  return openssl_error(err);
+}
 
-  auto& annots = page.dict["Annots"];
-  if (annots.type != pdf_object::ARRAY) {
-    // TODO indirectly referenced arrays might not be that hard to support
-    if (annots.type != pdf_object::END)
-      return "unexpected Annots";
+// -------------------------------------------------------------------------------------------------
+
+/// Read exactly `len' bytes from a socket, accepting a file descriptor if `passed_fd' is given.
+/// Returns false on errors, including cut-off ancillary data or more than one descriptor,
+/// as well as if the peer has closed the connection.
+static bool recv_all(int fd, void* buf, size_t len, int* passed_fd = nullptr) {
+  union {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } control = {};
+
+  auto p = static_cast<char*>(buf);
+  while (len) {
+    struct iovec iov = {p, len};
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (passed_fd) {
+      msg.msg_control = control.buf;
+      msg.msg_controllen = sizeof control.buf;
+    }
+
+    auto n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+
+    // Alignment padding may well have room for more descriptors than asked for
+    bool extra = false;
+    for (auto cmsg = CMSG_FIRSTHDR(&msg); passed_fd && cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        continue;
+      for (size_t i = 0; i < (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int); i++) {
+        if (*passed_fd != -1)
+          close(*passed_fd), extra = true;
+        memcpy(passed_fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+      }
+    }
+    if (passed_fd && (extra || (msg.msg_flags & MSG_CTRUNC)))
+      return false;
 
-    annots = {pdf_object::ARRAY};
+    p += n;
+    len -= n;
   }
-  annots.array.emplace_back(pdf_object::REFERENCE, sigfield_n, 0);
-  pdf.update(page.n, [&] { pdf.document += pdf_serialize(page); });
+  return true;
+}
 
-  // 8.6.1 Interactive Form Dictionary
-  if (root.dict.count("AcroForm"))
-    return "the document already contains forms, they would be overwritten";
-
-  root.dict["AcroForm"] = {std::map<std::string, pdf_object>{
-    {"Fields", {std::vector<pdf_object>{
-      {pdf_object::REFERENCE, sigfield_n, 0}
-    }}},
-    {"SigFlags", {pdf_object::NUMERIC, 3 /* SignaturesExist | AppendOnly */}}
-  }};
+static uint64_t decode_be(const unsigned char* p, size_t len) {
+  uint64_t value = 0;
+  while (len--)
+    value = value << 8 | *p++;
+  return value;
+}
 
-  // Upgrade the document version for SHA-256 etc.
-  if (pdf.version(root) < 16)
-    root.dict["Version"] = {pdf_object::NAME, "1.6"};
+static void encode_be(unsigned char* p, size_t len, uint64_t value) {
+  while (len--) {
+    p[len] = value;
+    value >>= 8;
+  }
+}
 
-  pdf.update(root_ref->second.n, [&] { pdf.document += pdf_serialize(root); });
-  pdf.flush_updates();
+/// Documents larger than this are expected to be passed as file descriptors
+static constexpr uint64_t serve_max_inline = uint64_t(1) << 26;
 
-  // Now that we know the length of everything, store byte ranges of what we're about to sign,
-  // which must be everything but the resulting signature itself
-  size_t tail_off = sign_off + sign_len, tail_len = pdf.document.size() - tail_off;
-  auto ranges = ssprintf("[0 %zu %zu %zu]", sign_off, tail_off, tail_len);
-  if (ranges.length() > byterange_len)
-    return "not enough space reserved for /ByteRange";
-  pdf.document.replace(byterange_off, std::min(ranges.length(), byterange_len), ranges);
-  return pdf_fill_in_signature(pdf.document, sign_off, sign_len);
+/// Limit on concurrently served connections, which also bounds memory used for inline documents
+static constexpr unsigned serve_max_clients = 16;
+
+/// Process requests on a client connection until it gets closed.  Each request consists of
+/// a 32-bit signature reservation, where zero stands for the default, and a 64-bit document length,
+/// followed by the document itself.  Alternatively, the length may be zero, and a file descriptor
+/// to read the document from may be attached to the header.  Each response consists of an 8-bit
+/// status, either zero or the exit status of the respective command line failure, and a 64-bit
+/// data length, followed by either the signed document or an error message.
+/// All numbers are in network byte order.  Where the announced document hasn't been read,
+/// the connection is closed after the error response.
+static void serve_client(int client, const std::vector<const pdf_signer*>& signers,
+    pdf_digest_cache& cache, pdf_sign_options defaults, bool show_stats) {
+  while (1) {
+    unsigned char header[12] = {};
+    int passed_fd = -1;
+    if (!recv_all(client, header, sizeof header, &passed_fd)) {
+      if (passed_fd != -1)
+        close(passed_fd);
+      break;
+    }
+
+    auto reservation = decode_be(header, 4);
+    auto length = decode_be(header + 4, 8);
+
+    int status = 1;
+    pdf_stats stats(show_stats);
+    input_file input;
+    std::string updates, err;
+    bool unread = false;
+    if (passed_fd != -1) {
+      input.fd = passed_fd;
+      if ((unread = length))
+        err = "a passed file descriptor must come with a zero length";
+      else
+        err = input.load("passed file descriptor");
+    } else if ((unread = length > serve_max_inline)) {
+      err = "the document is too large, pass a file descriptor instead";
+    } else {
+      pdf_stats::timer timer(pdf_stats::READ);
+      input.buffer.resize(length);
+      if (!recv_all(client, &input.buffer[0], length))
+        break;
+      input.data = input.buffer.data();
+      input.length = input.buffer.length();
+    }
+
+    if (err.empty() && reservation > USHRT_MAX)
+      err = "invalid reservation";
+    if (err.empty()) {
+      auto options = defaults;
+      if (reservation)
+        options.reservation = reservation, options.auto_reserve = false;
+      status = 2;
+
+      // Passed file descriptors are likely to be sent again, e.g., with a larger reservation
+      pdf_digest_cache::key file;
+      bool known = input.identify(file);
+      pdf_digest digest(input.data, input.length, known ? &cache : nullptr, file);
+      err = pdf_sign(input.data, input.length, updates, digest, signers, options);
+    }
+
+    unsigned char response[9] = {};
+    std::vector<struct iovec> iov{{response, sizeof response}};
+    if (!err.empty()) {
+      response[0] = status;
+      encode_be(response + 1, 8, err.length());
+      iov.push_back({&err[0], err.length()});
+    } else {
+      encode_be(response + 1, 8, input.length + updates.length());
+      iov.push_back({const_cast<char*>(input.data), input.length});
+      iov.push_back({&updates[0], updates.length()});
+    }
+    {
+      pdf_stats::timer timer(pdf_stats::WRITE);
+      if (!send_all(client, iov))
+        break;
+    }
+    if (show_stats)
+      fprintf(stderr, "{\"status\": %d, \"length\": %zu, %s}\n",
+              err.empty() ? 0 : status, input.length, stats.json().c_str());
+    if (unread)
+      break;
+  }
+  close(client);
 }
 
-// -------------------------------------------------------------------------------------------------
+/// Accept connections on a UNIX socket forever, keeping key pairs loaded in memory
+static void serve(const std::vector<const pdf_signer*>& signers, pdf_digest_cache& cache,
+    const char* socket_path, const pdf_sign_options& options, bool show_stats) {
+  struct sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof addr.sun_path)
+    die(1, "%s: %s", socket_path, "socket path too long");
+  strcpy(addr.sun_path, socket_path);
 
-__attribute__((format(printf, 2, 3)))
-static void die(int status, const char* format, ...) {
-  va_list ap;
-  va_start(ap, format);
-  if (isatty(fileno(stderr)))
-    vfprintf(stderr, ssprintf("\x1b[31m%s\x1b[0m\n", format).c_str(), ap);
-  else
-    vfprintf(stderr, format, ap);
-  va_end(ap);
-  exit(status);
+  // Replace stale sockets, but nothing else
+  struct stat st = {};
+  if (!lstat(socket_path, &st) && S_ISSOCK(st.st_mode))
+    (void) unlink(socket_path);
+
+  int server = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (server == -1 || bind(server, (struct sockaddr*) &addr, sizeof addr) ||
+      listen(server, SOMAXCONN))
+    die(1, "%s: %s", socket_path, strerror(errno));
+
+  // Further connections wait in the backlog until a client thread finishes
+  std::mutex mutex;
+  std::condition_variable finished;
+  unsigned clients = 0;
+  while (1) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      finished.wait(lock, [&] { return clients < serve_max_clients; });
+    }
+
+    int client = accept4(server, nullptr, nullptr, SOCK_CLOEXEC);
+    if (client == -1 && (errno == EINTR || errno == ECONNABORTED))
+      continue;
+    if (client == -1)
+      die(1, "%s: %s", "accept", strerror(errno));
+
+    std::lock_guard<std::mutex> lock(mutex);
+    clients++;
+    std::thread([&, client] {
+      serve_client(client, signers, cache, options, show_stats);
+      std::lock_guard<std::mutex> lock(mutex);
+      clients--;
+      finished.notify_one();
+    }).detach();
+  }
 }
 
+// -------------------------------------------------------------------------------------------------
+
 int main(int argc, char* argv[]) {
   auto invocation_name = argv[0];
   auto usage = [=] {
-    die(1, "Usage: %s [-h] [-r RESERVATION] INPUT-FILENAME OUTPUT-FILENAME PKCS12-PATH PKCS12-PASS",
-        invocation_name);
+    die(1, "Usage: %s [-h] [-r RESERVATION | --auto-reserve] [-p PAGE] [-t TSA-URL] [--stats]"
+        " INPUT-FILENAME OUTPUT-FILENAME KEY-PAIR PASSWORD...\n"
+        "       %s [-h] [-r RESERVATION | --auto-reserve] [-p PAGE] [-t TSA-URL] [--stats]"
+        " --in-place FILENAME KEY-PAIR PASSWORD...\n"
+        "       %s [-h] [-r RESERVATION | --auto-reserve] [-p PAGE] [-t TSA-URL] [--stats]"
+        " [--in-place] [-j JOBS] -b MANIFEST KEY-PAIR PASSWORD...\n"
+        "       %s [-h] [-r RESERVATION | --auto-reserve] [-p PAGE] [-t TSA-URL] [--stats]"
+        " --serve SOCKET KEY-PAIR PASSWORD...\n"
+        "       %s [-h] [-r RESERVATION] [-p PAGE] [--stats]"
+        " --prepare STATE INPUT-FILENAME OUTPUT-FILENAME\n"
+        "       %s [-h] [-t TSA-URL] [--stats]"
+        " --complete STATE OUTPUT-FILENAME SIGNATURE CERTIFICATES\n"
+        "       %s [-h] [--stats] --verify CA-CERTIFICATES FILENAME\n"
+        "       %s [-h] [--stats] [-j JOBS] --verify CA-CERTIFICATES -b MANIFEST",
+        invocation_name, invocation_name, invocation_name, invocation_name, invocation_name,
+        invocation_name, invocation_name, invocation_name);
   };
 
   static struct option opts[] = {
     {"help", no_argument, 0, 'h'},
     {"version", no_argument, 0, 'V'},
     {"reservation", required_argument, 0, 'r'},
+    {"auto-reserve", no_argument, 0, 'A'},
+    {"tsa", required_argument, 0, 't'},
+    {"page", required_argument, 0, 'p'},
+    {"batch", required_argument, 0, 'b'},
+    {"jobs", required_argument, 0, 'j'},
+    {"in-place", no_argument, 0, 'I'},
+    {"serve", required_argument, 0, 'S'},
+    {"stats", no_argument, 0, 's'},
+    {"prepare", required_argument, 0, 'P'},
+    {"complete", required_argument, 0, 'C'},
+    {"verify", required_argument, 0, 'v'},
     {nullptr, 0, 0, 0},
   };
 
-  // Reserved space in bytes for the certificate, digest, encrypted digest, ...
-  long reservation = 4096;
+  pdf_sign_options options;
+  const char* manifest_path = nullptr, * socket_path = nullptr, * tsa_url = nullptr;
+  const char* prepare_path = nullptr, * complete_path = nullptr, * verify_path = nullptr;
+  long jobs = 1;
+  bool in_place = false, show_stats = false;
   while (1) {
     int option_index = 0;
-    auto c = getopt_long(argc, const_cast<char* const*>(argv), "hVr:", opts, &option_index);
+    auto c = getopt_long(argc, const_cast<char* const*>(argv), "hVr:p:t:b:j:", opts, &option_index);
     if (c == -1)
       break;
 
     char* end = nullptr;
     switch (c) {
-    case 'r':
-      errno = 0, reservation = strtol(optarg, &end, 10);
+    case 'r': {
+      errno = 0;
+      auto reservation = strtol(optarg, &end, 10);
       if (errno || *end || reservation <= 0 || reservation > USHRT_MAX)
         die(1, "%s: must be a positive number", optarg);
+      options.reservation = reservation;
+      break;
+    }
+    case 'A':
+      options.auto_reserve = true;
+      break;
+    case 't':
+      tsa_url = optarg;
+      break;
+    case 'p':
+      errno = 0, options.page = strtol(optarg, &end, 10);
+      if (errno || *end || !options.page)
+        die(1, "%s: must be a non-zero number", optarg);
+      break;
+    case 'b':
+      manifest_path = optarg;
+      break;
+    case 'S':
+      socket_path = optarg;
+      break;
+    case 'I':
+      in_place = true;
+      break;
+    case 's':
+      show_stats = true;
+      break;
+    case 'P':
+      prepare_path = optarg;
+      break;
+    case 'C':
+      complete_path = optarg;
+      break;
+    case 'v':
+      verify_path = optarg;
+      break;
+    case 'j':
+      errno = 0, jobs = strtol(optarg, &end, 10);
+      if (errno || *end || jobs <= 0 || jobs > 1024)
+        die(1, "%s: must be a positive number", optarg);
       break;
     case 'V':
       die(0, "%s", PROJECT_NAME " " PROJECT_VERSION);
@@ -979,39 +4263,107 @@ int main(int argc, char* argv[]) {
   argv += optind;
   argc -= optind;
 
-  if (argc != 4)
-    usage();
+  // Verification needs no key pairs, only certificates to trust
+  if (verify_path) {
+    if (socket_path || in_place || prepare_path || complete_path || argc != !manifest_path)
+      usage();
 
-  const char* input_path  = argv[0];
-  const char* output_path = argv[1];
-  pkcs12_path = argv[2];
-  pkcs12_pass = argv[3];
-
-  std::string pdf_document;
-  if (auto fp = fopen(input_path, "rb")) {
-    int c;
-    while ((c = fgetc(fp)) != EOF)
-      pdf_document += c;
-    if (ferror(fp))
-      die(1, "%s: %s", input_path, strerror(errno));
-    fclose(fp);
-  } else {
-    die(1, "%s: %s", input_path, strerror(errno));
+    pdf_stats stats(show_stats);
+    X509_STORE* store = nullptr;
+    std::string err = load_trusted(verify_path, store);
+    if (!err.empty())
+      die(1, "%s", err.c_str());
+
+    int status = 0;
+    std::string report;
+    if (manifest_path)
+      status = run_batch(manifest_path, false, jobs, show_stats,
+                         [&](const char* input, const char*, std::string& err) {
+                           return verify_file(store, input, err);
+                         });
+    else
+      status = verify_file(store, argv[0], err, &report);
+
+    X509_STORE_free(store);
+    fputs(report.c_str(), stdout);
+    if (show_stats && !manifest_path)
+      fputs(stats.summary().c_str(), stderr);
+    if (status && !manifest_path)
+      die(status, "%s", err.c_str());
+    return status;
   }
 
-  auto err = pdf_sign(pdf_document, ushort(reservation));
-  if (!err.empty()) {
-    die(2, "Error: %s", err.c_str());
+  // Two-phase signing handles one document at a time, and the signature is made elsewhere
+  if (prepare_path || complete_path) {
+    if (manifest_path || socket_path || in_place || (prepare_path && complete_path) ||
+        (prepare_path && (argc != 2 || options.auto_reserve || tsa_url)) ||
+        (complete_path && argc != 3))
+      usage();
+
+    pdf_stats stats(show_stats);
+    pdf_tsa tsa;
+    std::string err;
+    if (tsa_url && !(err = tsa.set_url(tsa_url)).empty())
+      die(1, "%s", err.c_str());
+
+    auto status = prepare_path
+      ? prepare_file(argv[0], argv[1], prepare_path, options, err)
+      : complete_file(complete_path, argv[0], argv[1], argv[2], tsa_url ? &tsa : nullptr, err);
+    if (show_stats)
+      fputs(stats.summary().c_str(), stderr);
+    if (status)
+      die(status, "%s", err.c_str());
+    return 0;
   }
 
-  if (auto fp = fopen(output_path, "wb")) {
-    auto written = fwrite(pdf_document.c_str(), pdf_document.size(), 1, fp);
-    if (fclose(fp) || written != 1) {
-      (void) unlink(output_path);
-      die(3, "%s: %s", output_path, strerror(errno));
+  // Any number of key pairs may follow, each of them adding another signature
+  int first_key = (manifest_path || socket_path) ? 0 : in_place ? 1 : 2;
+  if ((manifest_path && socket_path) || (socket_path && in_place) ||
+      argc < first_key + 2 || (argc - first_key) % 2)
+    usage();
+
+  // In batch and server mode, this only covers loading key pairs, documents get their own
+  pdf_stats stats(show_stats);
+
+  // Key pairs are only decrypted once, however many documents there are to sign
+  std::list<pdf_key_signer> loaded;
+  std::vector<const pdf_signer*> signers;
+  std::string err;
+  {
+    pdf_stats::timer timer(pdf_stats::KEYS);
+    for (int i = first_key; i < argc; i += 2) {
+      loaded.emplace_back();
+      if (!(err = is_uri(argv[i]) ? loaded.back().load_store(argv[i], argv[i + 1])
+                                  : loaded.back().load_pkcs12(argv[i], argv[i + 1])).empty())
+        die(2, "Error: %s", err.c_str());
+      signers.push_back(&loaded.back());
     }
-  } else {
-    die(3, "%s: %s", output_path, strerror(errno));
   }
+  if (show_stats && (manifest_path || socket_path))
+    fprintf(stderr, "{\"signers\": %zu, %s}\n", signers.size(), stats.json().c_str());
+
+  // Connections to the TSA are kept open for subsequent signatures
+  pdf_tsa tsa;
+  if (tsa_url) {
+    if (!(err = tsa.set_url(tsa_url)).empty())
+      die(1, "%s", err.c_str());
+    options.tsa = &tsa;
+  }
+
+  // Documents that have already been hashed once need not be hashed again
+  pdf_digest_cache cache;
+  if (manifest_path)
+    return run_batch(manifest_path, !in_place, jobs, show_stats,
+                     [&](const char* input, const char* output, std::string& err) {
+                       return sign_file(signers, cache, input, output, options, err);
+                     });
+  if (socket_path)
+    serve(signers, cache, socket_path, options, show_stats);
+
+  auto status = sign_file(signers, cache, argv[0], in_place ? nullptr : argv[1], options, err);
+  if (show_stats)
+    fputs(stats.summary().c_str(), stderr);
+  if (status)
+    die(status, "%s", err.c_str());
   return 0;
 }
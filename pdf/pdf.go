@@ -1520,6 +1520,35 @@ func FillInSignature(document []byte, signOff, signLen int,
 	return nil
 }
 
+// appendReference appends a reference to an array, which is either held
+// directly by the given dictionary entry, in which case it may also be missing,
+// or referenced by it, in which case it gets updated.
+func (u *Updater) appendReference(entry *Object, n uint, what string) error {
+	if entry.Kind == End {
+		*entry = NewArray(nil)
+	}
+	if entry.Kind == Array {
+		entry.Array = append(entry.Array, NewReference(n, 0))
+		return nil
+	}
+	if entry.Kind != Reference {
+		return fmt.Errorf("unexpected %s", what)
+	}
+
+	array, err := u.Get(entry.N, entry.Generation)
+	if err != nil {
+		return err
+	}
+	if array.Kind != Array {
+		return fmt.Errorf("invalid %s reference", what)
+	}
+	array.Array = append(array.Array, NewReference(n, 0))
+	u.Update(entry.N, func(buf BytesWriter) {
+		buf.WriteString(array.Serialize())
+	})
+	return nil
+}
+
 // https://www.adobe.com/devnet-docs/acrobatetk/tools/DigSig/Acrobat_DigitalSignatures_in_PDF.pdf
 // https://www.adobe.com/content/dam/acom/en/devnet/acrobat/pdfs/pdf_reference_1-7.pdf
 // https://www.adobe.com/content/dam/acom/en/devnet/acrobat/pdfs/PPKAppearances.pdf
@@ -1553,6 +1582,36 @@ func Sign(document []byte, key crypto.PrivateKey, certs []*x509.Certificate,
 		return nil, errors.New("invalid Root dictionary reference")
 	}
 
+	// 8.6.1 Interactive Form Dictionary
+	acroformRef, hasAcroform := root.Dict["AcroForm"]
+	acroform := NewDict(map[string]Object{})
+	if hasAcroform && acroformRef.Kind != Nil {
+		if acroform, err = pdf.Dereference(acroformRef); err != nil {
+			return nil, err
+		}
+		if acroform.Kind != Dict {
+			return nil, errors.New("invalid AcroForm")
+		}
+	}
+
+	// Fully qualified field names ought to be unique,
+	// so avoid those of other top-level fields.
+	fields, err := pdf.Dereference(acroform.Dict["Fields"])
+	if err != nil {
+		return nil, err
+	}
+	names := map[string]bool{}
+	for _, field := range fields.Array {
+		if field, err := pdf.Dereference(field); err == nil &&
+			field.Kind == Dict && field.Dict["T"].Kind == String {
+			names[field.Dict["T"].String] = true
+		}
+	}
+	fieldNumber := 1
+	for names[fmt.Sprintf("Signature%d", fieldNumber)] {
+		fieldNumber++
+	}
+
 	// 8.7 Digital Signatures - /signature dictionary/
 	sigdictN := pdf.Allocate()
 	var byterangeOff, byterangeLen, signOff, signLen int
@@ -1587,7 +1646,7 @@ func Sign(document []byte, key crypto.PrivateKey, certs []*x509.Certificate,
 		// We can merge the Signature Annotation and omit Kids here.
 		"Subtype": NewName("Widget"),
 		"F":       NewNumeric(2 /* Hidden */),
-		"T":       NewString("Signature1"),
+		"T":       NewString(fmt.Sprintf("Signature%d", fieldNumber)),
 		"Rect": NewArray([]Object{
 			NewNumeric(0), NewNumeric(0), NewNumeric(0), NewNumeric(0),
 		}),
@@ -1608,31 +1667,37 @@ func Sign(document []byte, key crypto.PrivateKey, certs []*x509.Certificate,
 	}
 
 	annots := page.Dict["Annots"]
-	if annots.Kind != Array {
-		// TODO(p): Indirectly referenced arrays might not be
-		// that hard to support.
-		if annots.Kind != End {
-			return nil, errors.New("unexpected Annots")
-		}
-		annots = NewArray(nil)
+	if err := pdf.appendReference(&annots, sigfieldN, "Annots"); err != nil {
+		return nil, err
+	}
+	if page.Dict["Annots"].Kind != Reference {
+		page.Dict["Annots"] = annots
+		pdf.Update(page.N, func(buf BytesWriter) {
+			buf.WriteString(page.Serialize())
+		})
 	}
-	annots.Array = append(annots.Array, NewReference(sigfieldN, 0))
 
-	page.Dict["Annots"] = annots
-	pdf.Update(page.N, func(buf BytesWriter) {
-		buf.WriteString(page.Serialize())
-	})
+	fields = acroform.Dict["Fields"]
+	if err := pdf.appendReference(&fields, sigfieldN, "Fields"); err != nil {
+		return nil, err
+	}
+	acroform.Dict["Fields"] = fields
 
-	// 8.6.1 Interactive Form Dictionary
-	if acroform, ok := root.Dict["AcroForm"]; ok && acroform.Kind != Nil {
-		return nil, errors.New("the document already contains forms, " +
-			"they would be overwritten")
+	sigflags := 0
+	if flags, err := pdf.Dereference(acroform.Dict["SigFlags"]); err == nil &&
+		flags.IsInteger() && flags.Number >= 0 && flags.Number <= math.MaxInt32 {
+		sigflags = int(flags.Number)
 	}
+	acroform.Dict["SigFlags"] =
+		NewNumeric(float64(sigflags | 3 /* SignaturesExist | AppendOnly */))
 
-	root.Dict["AcroForm"] = NewDict(map[string]Object{
-		"Fields":   NewArray([]Object{NewReference(sigfieldN, 0)}),
-		"SigFlags": NewNumeric(3 /* SignaturesExist | AppendOnly */),
-	})
+	if acroformRef.Kind == Reference {
+		pdf.Update(acroformRef.N, func(buf BytesWriter) {
+			buf.WriteString(acroform.Serialize())
+		})
+	} else {
+		root.Dict["AcroForm"] = acroform
+	}
 
 	// Upgrade the document version for SHA-256 etc.
 	if pdf.Version(&root) < 16 {
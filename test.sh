@@ -56,6 +56,15 @@ openssl pkcs12 -inkey tmp/key.pem -in tmp/cert.pem \
 	-certpbe PBE-SHA1-3DES -keypbe PBE-SHA1-3DES -macalg sha1 \
 	-export -passout pass: -out tmp/key-pair.p12
 
+# And another one, for applying several key pairs at once
+openssl req -newkey rsa:2048 -subj "/CN=Test Leaf 2" -nodes \
+	-keyout tmp/key2.pem -out tmp/cert2.csr 2>/dev/null
+openssl x509 -req -in tmp/cert2.csr -out tmp/cert2.pem \
+	-CA tmp/ca.cert.pem -CAkey tmp/ca.key.pem -set_serial 2 \
+	-extensions smime -extfile tmp/cert.cfg 2>/dev/null
+openssl pkcs12 -inkey tmp/key2.pem -in tmp/cert2.pem \
+	-export -passout pass: -out tmp/key-pair-2.p12
+
 for tool in "$@"; do
 	rm -f tmp/*.signed.pdf
 	for source in tmp/*.pdf; do
@@ -71,9 +80,13 @@ for tool in "$@"; do
 			|| die "Version detection seems to misbehave (no upgrade)"
 	done
 
+	log "Testing $tool for signing signed documents"
+	$tool "$result" "$result.double" tmp/key-pair.p12 ""
+	[ "`pdfsig -nssdir sql:tmp/nssdir "$result.double" \
+		| grep -c "Signature is Valid"`" = 2 ] \
+		|| die "Double signing seems to misbehave"
+
 	log "Testing $tool for expected failures"
-	$tool "$result" "$source.fail.pdf" tmp/key-pair.p12 "" \
-		&& die "Double signing shouldn't succeed"
 	$tool -r 1 "$source" "$source.fail.pdf" tmp/key-pair.p12 "" \
 		&& die "Too low reservations shouldn't succeed"
 
@@ -83,4 +96,11 @@ for tool in "$@"; do
 		&& die "Version detection seems to misbehave (downgraded)"
 done
 
+# Only the C++ version takes several key pairs
+log "Testing $1 for signing with two key pairs at once"
+$1 "$source" "$source.two.pdf" tmp/key-pair.p12 "" tmp/key-pair-2.p12 ""
+[ "`pdfsig -nssdir sql:tmp/nssdir "$source.two.pdf" \
+	| grep -c "Signature is Valid"`" = 2 ] \
+	|| die "Signing with two key pairs seems to misbehave"
+
 log "OK"